@@ -8,7 +8,17 @@
 #include <cassert>
 #include <cstdlib>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <new>
+
+#ifdef _WINDOWS
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
 
 #define EXPECT(c, ch) do { assert(*(c -> json) == (ch)); c -> json++; } while(0)
 #define ISDIGIT(ch) (ch >= '0' && ch <= '9')
@@ -16,14 +26,35 @@
 
 #define STRING_ERROR(error) do { c -> top = head; return error; } while(0)
 
+#define ARENA_ROUND(size) (((size) + alignof(value) - 1) & ~(alignof(value) - 1))
+
+#define ESCAPE_ROW_NONE 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
 #ifndef PARSE_STACK_INIT_CAPACITY
 #define PARSE_STACK_INIT_CAPACITY 256
 #endif
 
 namespace lept {
 
+    enum {
+        CONTEXT_COPY_ON_WRITE = 1u << 31, // patching a document, beside the PARSE_* flags
+    };
+
+    struct projection {
+        char *key = nullptr; // member name matched by this node
+        size_t kLen = 0;
+        int terminal = 0;    // the whole subtree is selected
+        projection *kids = nullptr;
+        size_t size = 0;
+        projection *anyMember = nullptr; // .*
+        projection *elements = nullptr;  // [*]
+    };
+
     struct context {
         const char *json = "";
+        unsigned flags = 0;
+        const projection *proj = nullptr; // nullptr selects everything
+        context *arena = nullptr; // storage of a batch, see parse_many()
         char *stack = nullptr;
         size_t capacity = 0, top = 0;
     };
@@ -49,6 +80,15 @@ namespace lept {
         return c -> stack + (c -> top -= size);
     }
 
+    // storage for parsed strings and containers, *ref receives what the value keeps:
+    // a heap pointer, or an offset into c -> arena that relocate() turns into a pointer
+    static char* context_alloc(context *c, size_t size, char **ref) {
+        if (c -> arena == nullptr)
+            return *ref = (char*)malloc(size);
+        *ref = (char*)(uintptr_t)c -> arena -> top;
+        return (char*)context_push(c -> arena, ARENA_ROUND(size));
+    }
+
     static const char* parse_hex4(const char *p, unsigned *u) {
         *u = 0;
         for (size_t i = 0; i < 4; i++) {
@@ -108,35 +148,47 @@ namespace lept {
         return PARSE_OK;
     }
 
-    static int parse_number(context *c, value *v) {
-        const char *p = c -> json;
-
+    // returns the end of the number starting at p, or nullptr if it is invalid
+    static const char* scan_number(const char *p) {
         if (*p == '-') p++;
 
         if (*p == '0') p++;
         else {
-            if (!ISDIGIT(*p)) return PARSE_INVALID_VALUE;
+            if (!ISDIGIT(*p)) return nullptr;
             while (ISDIGIT(*p)) p++;
         }
 
         if (*p == '.') {
             p++;
-            if (!ISDIGIT(*p)) return PARSE_INVALID_VALUE;
+            if (!ISDIGIT(*p)) return nullptr;
             while (ISDIGIT(*p)) p++;
         }
 
         if (*p == 'e' || *p == 'E') {
             p++;
             if (*p == '-' || *p == '+') p++;
-            if (!ISDIGIT(*p)) return PARSE_INVALID_VALUE;
+            if (!ISDIGIT(*p)) return nullptr;
             while (ISDIGIT(*p)) p++;
         }
+        return p;
+    }
+
+    static int parse_number(context *c, value *v) {
+        const char *p = scan_number(c -> json);
 
-        errno = 0;
-        v -> u.n = strtod(c -> json, nullptr); // str to double
+        if (p == nullptr) return PARSE_INVALID_VALUE;
 
-        if (errno == ERANGE && (v -> u.n == HUGE_VAL || v -> u.n == -HUGE_VAL))
-            return PARSE_NUMBER_TOO_BIG;
+        if (c -> flags & PARSE_LAZY_NUMBER) {
+            v -> u.n.d = NAN;
+            v -> u.n.raw = c -> json;
+        } else {
+            errno = 0;
+            v -> u.n.d = strtod(c -> json, nullptr); // str to double
+            v -> u.n.raw = nullptr;
+
+            if (errno == ERANGE && (v -> u.n.d == HUGE_VAL || v -> u.n.d == -HUGE_VAL))
+                return PARSE_NUMBER_TOO_BIG;
+        }
 
         c -> json = p;
         v -> type = NUMBER;
@@ -202,15 +254,199 @@ namespace lept {
         int ret;
         char *s;
         size_t len;
-        if ((ret = parse_string_raw(c, &s, &len)) == PARSE_OK)
-            set_string(v, s, len);
+        char *dst;
+        if ((ret = parse_string_raw(c, &s, &len)) != PARSE_OK)
+            return ret;
 
-        return ret;
+        if (len < INLINE_STRING_CAPACITY) {
+            set_string(v, s, len);
+        } else {
+            memcpy(dst = context_alloc(c, len + 1, &v -> u.s.s), s, len);
+            dst[len] = '\0';
+            v -> u.s.len = len;
+            v -> type = STRING;
+        }
+        return PARSE_OK;
     }
 
     static int parse_value(context *c, value *v);
 
+    /* skipping: same checks and errors as parsing, but nothing is stored; numbers
+       are only scanned, so PARSE_NUMBER_TOO_BIG is never reported */
+
+    static int skip_value(context *c);
+
+    static int skip_string(context *c) {
+        unsigned u = 0, u2 = 0;
+        const char *p;
+        EXPECT(c, '\"');
+        p = c -> json;
+
+        while (true) {
+            p += strcspn(p, "\"\\");
+            switch (*p++) {
+                case '\"':
+                    c -> json = p;
+                    return PARSE_OK;
+                case '\0':
+                    return PARSE_MISS_QUOTATION_MARK;
+                default: // backslash
+                    switch (*p++) {
+                        case '\"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                            break;
+                        case 'u':
+                            if (!(p = parse_hex4(p, &u)))
+                                return PARSE_INVALID_UNICODE_HEX;
+                            if (u >= 0xD800 && u <= 0xDBFF) {
+                                if (*p++ != '\\' || *p++ != 'u')
+                                    return PARSE_INVALID_UNICODE_SURROGATE;
+                                if (!(p = parse_hex4(p, &u2)))
+                                    return PARSE_INVALID_UNICODE_HEX;
+                                if (u2 < 0xDC00 || u2 > 0xDFFF)
+                                    return PARSE_INVALID_UNICODE_SURROGATE;
+                            }
+                            break;
+                        default:
+                            return PARSE_INVALID_STRING_ESCAPE;
+                    }
+            }
+        }
+    }
+
+    static int skip_array(context *c) {
+        int ret;
+        EXPECT(c, '[');
+        parse_whitespace(c);
+        if (*c -> json == ']') {
+            c -> json++;
+            return PARSE_OK;
+        }
+
+        while (true) {
+            parse_whitespace(c);
+            if ((ret = skip_value(c)) != PARSE_OK)
+                return ret;
+            parse_whitespace(c);
+            if (*c -> json == ',') {
+                c -> json++;
+            } else if (*c -> json == ']') {
+                c -> json++;
+                return PARSE_OK;
+            } else {
+                return PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            }
+        }
+    }
+
+    static int skip_object(context *c) {
+        int ret;
+        EXPECT(c, '{');
+        parse_whitespace(c);
+        if (*c -> json == '}') {
+            c -> json++;
+            return PARSE_OK;
+        }
+
+        while (true) {
+            if (*c -> json != '"')
+                return PARSE_MISS_KEY;
+            if ((ret = skip_string(c)) != PARSE_OK)
+                return ret;
+            parse_whitespace(c);
+            if (*c -> json != ':')
+                return PARSE_MISS_COLON;
+            c -> json++;
+            parse_whitespace(c);
+            if ((ret = skip_value(c)) != PARSE_OK)
+                return ret;
+            parse_whitespace(c);
+            if (*c -> json == ',') {
+                c -> json++;
+                parse_whitespace(c);
+            } else if (*c -> json == '}') {
+                c -> json++;
+                return PARSE_OK;
+            } else {
+                return PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+            }
+        }
+    }
+
+    static int skip_value(context *c) {
+        value literal; // literals carry no storage
+        const char *p;
+        switch (*c -> json) {
+            case 't': return parse_literal(c, &literal, "true", TRUE);
+            case 'f': return parse_literal(c, &literal, "false", FALSE);
+            case 'n': return parse_literal(c, &literal, "null", NUL);
+            case '[': return skip_array(c);
+            case '{': return skip_object(c);
+            case '\"': return skip_string(c);
+            case '\0': return PARSE_EXPECT_VALUE;
+            default:
+                if ((p = scan_number(c -> json)) == nullptr)
+                    return PARSE_INVALID_VALUE;
+                c -> json = p;
+                return PARSE_OK;
+        }
+    }
+
+    // the projection for a selected child, nullptr once the whole subtree is selected
+    static const projection* projection_enter(const projection *child) {
+        return child -> terminal ? nullptr : child;
+    }
+
+    // whether a member or element starting with ch can hold anything selected by node
+    static int projection_match(const projection *node, char ch) {
+        return node -> terminal || (ch == '{' && (node -> size || node -> anyMember)) || (ch == '[' && node -> elements);
+    }
+
+    static const projection* projection_find(const projection *node, const char *key, size_t kLen) {
+        for (size_t i = 0; i < node -> size; i++) {
+            if (node -> kids[i].kLen == kLen && memcmp(node -> kids[i].key, key, kLen) == 0)
+                return &node -> kids[i];
+        }
+        return node -> anyMember;
+    }
+
+    /* keys shorter than sizeof(m -> k) live in m -> ik instead of the heap */
+
+    static const char* member_key(const member *m) {
+        return m -> kLen < sizeof(m -> k) ? m -> ik : m -> k;
+    }
+
+    static void set_member_key(member *m, const char *k, size_t kLen) {
+        char *dst = kLen < sizeof(m -> k) ? m -> ik : (m -> k = (char*)malloc(kLen + 1));
+        if (kLen) memcpy(dst, k, kLen);
+        dst[kLen] = '\0';
+        m -> kLen = kLen;
+    }
+
+    static void parse_member_key(context *c, member *m, const char *k, size_t kLen) {
+        char *dst = kLen < sizeof(m -> k) ? m -> ik : context_alloc(c, kLen + 1, &m -> k);
+        if (kLen) memcpy(dst, k, kLen);
+        dst[kLen] = '\0';
+        m -> kLen = kLen;
+    }
+
+    // index of the member of v named like m, tries hint first as objects compared
+    // against each other usually share their key order
+    static size_t find_member(const value *v, const member *m, size_t hint) {
+        if (hint < v -> u.o.size && v -> u.o.m[hint].kLen == m -> kLen &&
+            memcmp(member_key(&v -> u.o.m[hint]), member_key(m), m -> kLen) == 0)
+            return hint;
+        return find_object_index(v, member_key(m), m -> kLen);
+    }
+
+    static void free_member_key(member *m) {
+        if (m -> kLen >= sizeof(m -> k))
+            free(m -> k);
+        m -> k = nullptr;
+        m -> kLen = 0;
+    }
+
     static int parse_array(context *c, value *v) {
+        const projection *node = c -> proj;
         size_t size = 0;
         int ret;
         EXPECT(c, '[');
@@ -225,12 +461,20 @@ namespace lept {
 
         while (true) {
             parse_whitespace(c);
-            value e;
-            if ((ret = parse_value(c, &e)) != PARSE_OK)
-                break;
+            if (node != nullptr && (node -> elements == nullptr || !projection_match(node -> elements, *c -> json))) {
+                if ((ret = skip_value(c)) != PARSE_OK)
+                    break;
+            } else {
+                value e;
+                c -> proj = node ? projection_enter(node -> elements) : nullptr;
+                ret = parse_value(c, &e);
+                c -> proj = node;
+                if (ret != PARSE_OK)
+                    break;
 
-            memcpy(context_push(c, sizeof(value)), &e, sizeof(value));
-            size++;
+                memcpy(context_push(c, sizeof(value)), &e, sizeof(value));
+                size++;
+            }
             parse_whitespace(c);
             if (*c -> json == ',') {
                 c -> json++;
@@ -238,7 +482,12 @@ namespace lept {
                 c -> json++;
                 v -> type = ARRAY;
                 v -> u.a.size = size;
-                memcpy(v -> u.a.e = new value[size], context_pop(c, size * sizeof(value)), size * sizeof(value));
+                v -> u.a.e = nullptr;
+                if (size) {
+                    char *e;
+                    memcpy(context_alloc(c, size * sizeof(value), &e), context_pop(c, size * sizeof(value)), size * sizeof(value));
+                    v -> u.a.e = (value*)e;
+                }
                 return  PARSE_OK;
             } else {
                 ret = PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
@@ -246,12 +495,17 @@ namespace lept {
             }
         }
 
+        if (c -> arena != nullptr) { // parse_many() rolls the whole message back
+            context_pop(c, size * sizeof(value));
+            return ret;
+        }
         for (size_t i = 0; i < size; i++)
             fre((value*)context_pop(c, sizeof(value)));
         return ret;
     }
 
     static int parse_object(context *c, value *v) {
+        const projection *node = c -> proj, *child = nullptr;
         size_t size = 0;
         member m;
         int ret;
@@ -267,17 +521,15 @@ namespace lept {
 
         while (true) {
             char *s;
+            size_t len;
             if ( *c -> json != '"') {
                 ret = PARSE_MISS_KEY;
                 break;
             }
 
-            if ((ret = parse_string_raw(c, &s, &m.kLen) != PARSE_OK))
+            if ((ret = parse_string_raw(c, &s, &len)) != PARSE_OK)
                 break;
 
-            memcpy(m.k = (char*)malloc(m.kLen + 1), s, m.kLen);
-            m.k[m.kLen] = '\0';
-
             parse_whitespace(c);
 
             if (*c -> json != ':') {
@@ -289,12 +541,23 @@ namespace lept {
 
             parse_whitespace(c);
 
-            if ((ret = parse_value(c, &m.v)) != PARSE_OK)
-                break;
+            if (node != nullptr && ((child = projection_find(node, s, len)) == nullptr || !projection_match(child, *c -> json))) {
+                if ((ret = skip_value(c)) != PARSE_OK)
+                    break;
+            } else {
+                parse_member_key(c, &m, s, len);
+                c -> proj = node ? projection_enter(child) : nullptr;
+                ret = parse_value(c, &m.v);
+                c -> proj = node;
+                if (ret != PARSE_OK)
+                    break;
 
-            memcpy(context_push(c, sizeof(member)), &m, sizeof(member));
-            size++;
-            m.k = nullptr; // has transferred to stack
+                memcpy(context_push(c, sizeof(member)), &m, sizeof(member));
+                size++;
+                m.k = nullptr; // has transferred to stack
+                m.kLen = 0;
+                m.v = value();
+            }
 
             parse_whitespace(c);
 
@@ -306,7 +569,12 @@ namespace lept {
                 c -> json++;
                 v -> type = OBJECT;
                 v -> u.o.size = size;
-                memcpy(v -> u.o.m = new member[size], context_pop(c, l), l);
+                v -> u.o.m = nullptr;
+                if (size) {
+                    char *block;
+                    memcpy(context_alloc(c, l, &block), context_pop(c, l), l);
+                    v -> u.o.m = (member*)block;
+                }
                 return PARSE_OK;
             } else {
                 ret = PARSE_MISS_COMMA_OR_CURLY_BRACKET;
@@ -314,10 +582,15 @@ namespace lept {
             }
         }
 
-        free(m.k);
+        if (c -> arena != nullptr) { // parse_many() rolls the whole message back
+            context_pop(c, size * sizeof(member));
+            v -> type = NUL;
+            return ret;
+        }
+        free_member_key(&m);
         for (size_t i = 0; i < size; i++) {
             member* m = (member*)context_pop(c,sizeof(member));
-            free(m -> k);
+            free_member_key(m);
             fre(&m -> v);
         }
 
@@ -338,67 +611,368 @@ namespace lept {
         }
     }
 
-    int parse(value *v, const char *json) {
+    int parse(value *v, const char *json, unsigned flags) {
+        return parse_projected(v, json, nullptr, flags);
+    }
+
+    int parse_projected(value *v, const char *json, const projection *p, unsigned flags) {
         context c;
         int ret;
 
         assert(v != nullptr);
 
         c.json = json;
+        c.flags = flags;
+        c.proj = p == nullptr ? nullptr : projection_enter(p);
         v -> type = NUL;
+        v -> flags = 0;
 
         parse_whitespace(&c);
 
         if ((ret = parse_value(&c, v)) == PARSE_OK) {
             parse_whitespace(&c);
             if (*c.json != '\0') {
-                v -> type = NUL;
+                fre(v);
                 ret = PARSE_ROOT_NOT_SINGULAR;
             }
         }
         assert(c.top == 0);
-        delete c.stack;
+        free(c.stack);
+
+        return ret;
+    }
+
+    /* batches: every message is parsed into one arena, which keeps offsets instead
+       of pointers while it grows and is relocated once it has its final address */
+
+    static void relocate(value *v, char *base, const char *text, const char *copy) {
+        switch (v -> type) {
+            case NUMBER:
+                if (v -> u.n.raw != nullptr)
+                    v -> u.n.raw = copy + (v -> u.n.raw - text);
+                break;
+            case STRING:
+                if (!(v -> flags & VALUE_INLINE_STRING))
+                    v -> u.s.s = base + (uintptr_t)v -> u.s.s;
+                break;
+            case ARRAY:
+                if (v -> u.a.size)
+                    v -> u.a.e = (value*)(base + (uintptr_t)v -> u.a.e);
+                for (size_t i = 0; i < v -> u.a.size; i++)
+                    relocate(&v -> u.a.e[i], base, text, copy);
+                break;
+            case OBJECT:
+                if (v -> u.o.size)
+                    v -> u.o.m = (member*)(base + (uintptr_t)v -> u.o.m);
+                for (size_t i = 0; i < v -> u.o.size; i++) {
+                    member *m = &v -> u.o.m[i];
+                    if (m -> kLen >= sizeof(m -> k))
+                        m -> k = base + (uintptr_t)m -> k;
+                    relocate(&m -> v, base, text, copy);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    const batch* parse_many(const char *buf, const size_t *offsets, const size_t *lens, size_t n, unsigned flags) {
+        context c, arena;
+        batch *b;
+        char *text, *p;
+        size_t total = 0, statusOff, valuesOff, textOff, head;
+
+        assert(n == 0 || (buf != nullptr && offsets != nullptr && lens != nullptr));
+
+        for (size_t i = 0; i < n; i++)
+            total += lens[i] + 1;
+
+        // block layout: batch, status[n], values[n], the input when numbers are lazy, then the arena
+        statusOff = ARENA_ROUND(sizeof(batch));
+        valuesOff = statusOff + ARENA_ROUND(n * sizeof(int));
+        textOff = valuesOff + n * sizeof(value);
+        head = textOff + (flags & PARSE_LAZY_NUMBER ? ARENA_ROUND(total) : 0);
+
+        arena.capacity = head + total + 1; // a first guess, grows like any context
+        arena.stack = (char*)malloc(arena.capacity);
+        context_push(&arena, head);
+
+        // messages are not terminated inside buf, parse terminated copies instead
+        p = text = (char*)malloc(total + 1);
+        c.flags = flags;
+        c.arena = &arena;
+
+        for (size_t i = 0; i < n; i++) {
+            size_t mark = arena.top;
+            value v;
+            int ret;
+
+            memcpy(p, buf + offsets[i], lens[i]);
+            p[lens[i]] = '\0';
+            c.json = p;
+            parse_whitespace(&c);
+
+            if ((ret = parse_value(&c, &v)) == PARSE_OK) {
+                parse_whitespace(&c);
+                if (c.json != p + lens[i]) // also catches a NUL byte inside the message
+                    ret = PARSE_ROOT_NOT_SINGULAR;
+            }
+            if (ret != PARSE_OK) {
+                arena.top = mark;
+                v = value();
+            }
+            memcpy(arena.stack + statusOff + i * sizeof(int), &ret, sizeof(int));
+            memcpy(arena.stack + valuesOff + i * sizeof(value), &v, sizeof(value));
+            p += lens[i] + 1;
+        }
+        assert(c.top == 0);
+        free(c.stack);
+
+        p = (char*)realloc(arena.stack, arena.top); // may move, nothing holds a pointer yet
+        b = new (p) batch();
+        b -> size = n;
+        b -> status = (int*)(p + statusOff);
+        b -> values = (value*)(p + valuesOff);
+        if (flags & PARSE_LAZY_NUMBER)
+            memcpy(p + textOff, text, total);
+        for (size_t i = 0; i < n; i++) {
+            if (b -> status[i] == PARSE_OK)
+                relocate((value*)&b -> values[i], p, text, p + textOff);
+        }
+        free(text);
+
+        return b;
+    }
+
+    void batch_free(const batch *b) {
+        free((void*)b);
+    }
+
+    /* projection trie, one node per path step */
+
+    static projection* projection_new() {
+        projection *node = (projection*)malloc(sizeof(projection));
+        *node = projection();
+        return node;
+    }
+
+    static void projection_clear(projection *node) {
+        for (size_t i = 0; i < node -> size; i++) {
+            free(node -> kids[i].key);
+            projection_clear(&node -> kids[i]);
+        }
+        free(node -> kids);
+        projection_free(node -> anyMember);
+        projection_free(node -> elements);
+    }
+
+    static projection* projection_member(projection *node, const char *key, size_t kLen) {
+        projection *kid;
+        for (size_t i = 0; i < node -> size; i++) {
+            if (node -> kids[i].kLen == kLen && memcmp(node -> kids[i].key, key, kLen) == 0)
+                return &node -> kids[i];
+        }
+
+        node -> kids = (projection*)realloc(node -> kids, (node -> size + 1) * sizeof(projection));
+        kid = &node -> kids[node -> size++];
+        *kid = projection();
+        memcpy(kid -> key = (char*)malloc(kLen + 1), key, kLen);
+        kid -> key[kLen] = '\0';
+        kid -> kLen = kLen;
+        return kid;
+    }
+
+    static int projection_add(projection *root, const char *p) {
+        projection *node = root;
+        if (*p++ != '$')
+            return PROJECTION_INVALID_PATH;
+
+        while (*p) {
+            if (p[0] == '.' && p[1] == '*') {
+                if (node -> anyMember == nullptr) node -> anyMember = projection_new();
+                node = node -> anyMember;
+                p += 2;
+            } else if (*p == '.') {
+                const char *key = ++p;
+                while (*p && *p != '.' && *p != '[') p++;
+                if (p == key)
+                    return PROJECTION_INVALID_PATH;
+                node = projection_member(node, key, p - key);
+            } else if (p[0] == '[' && p[1] == '*' && p[2] == ']') {
+                if (node -> elements == nullptr) node -> elements = projection_new();
+                node = node -> elements;
+                p += 3;
+            } else if (p[0] == '[' && (p[1] == '\'' || p[1] == '"')) {
+                const char *key = p + 2, *end = strchr(key, p[1]);
+                if (end == nullptr || end[1] != ']')
+                    return PROJECTION_INVALID_PATH;
+                node = projection_member(node, key, end - key);
+                p = end + 2;
+            } else {
+                return PROJECTION_INVALID_PATH;
+            }
+        }
+        node -> terminal = 1;
+        return PROJECTION_OK;
+    }
+
+    static void projection_merge(projection *dst, const projection *src) {
+        dst -> terminal |= src -> terminal;
+        for (size_t i = 0; i < src -> size; i++)
+            projection_merge(projection_member(dst, src -> kids[i].key, src -> kids[i].kLen), &src -> kids[i]);
+        if (src -> anyMember != nullptr) {
+            if (dst -> anyMember == nullptr) dst -> anyMember = projection_new();
+            projection_merge(dst -> anyMember, src -> anyMember);
+        }
+        if (src -> elements != nullptr) {
+            if (dst -> elements == nullptr) dst -> elements = projection_new();
+            projection_merge(dst -> elements, src -> elements);
+        }
+    }
+
+    // a named member is also reached through .*, so its node must select both
+    static void projection_link(projection *node) {
+        for (size_t i = 0; i < node -> size; i++) {
+            if (node -> anyMember != nullptr)
+                projection_merge(&node -> kids[i], node -> anyMember);
+            projection_link(&node -> kids[i]);
+        }
+        if (node -> anyMember != nullptr) projection_link(node -> anyMember);
+        if (node -> elements != nullptr) projection_link(node -> elements);
+    }
 
+    int projection_compile(projection **out, const char *const *paths, size_t n) {
+        projection *root;
+        int ret = PROJECTION_OK;
+        assert(out != nullptr && (paths != nullptr || n == 0));
+
+        root = projection_new();
+        for (size_t i = 0; i < n && ret == PROJECTION_OK; i++)
+            ret = projection_add(root, paths[i]);
+        if (ret != PROJECTION_OK) {
+            projection_free(root);
+            root = nullptr;
+        } else {
+            projection_link(root);
+        }
+        *out = root;
         return ret;
     }
 
+    void projection_free(projection *p) {
+        if (p != nullptr) {
+            projection_clear(p);
+            free(p);
+        }
+    }
+
+    /*
+     * shared blocks: the heap storage of a VALUE_SHARED value (string chars, array
+     * elements or members) is preceded by a reference count, so frozen subtrees can
+     * be owned by several documents at once.
+     */
+
+    struct alignas(16) shared_header {
+        std::atomic<size_t> refs;
+    };
+
+    static shared_header* shared_of(void *block) {
+        return (shared_header*)((char*)block - sizeof(shared_header));
+    }
+
+    static void* shared_alloc(size_t size) {
+        shared_header *h = (shared_header*)malloc(sizeof(shared_header) + size);
+        new (&h -> refs) std::atomic<size_t>(1);
+        return h + 1;
+    }
+
+    static void* value_block(const value *v) {
+        switch (v -> type) {
+            case STRING: return v -> flags & VALUE_INLINE_STRING ? nullptr : v -> u.s.s;
+            case ARRAY: return v -> u.a.e;
+            case OBJECT: return v -> u.o.m;
+            default: return nullptr;
+        }
+    }
+
+    static void block_free(const value *v, void *block) {
+        free(v -> flags & VALUE_SHARED && block != nullptr ? shared_of(block) : block);
+    }
+
+    // grows the storage of a container, a shared block must not be referenced elsewhere
+    static void* block_realloc(const value *v, void *block, size_t size) {
+        shared_header *h;
+        if (!(v -> flags & VALUE_SHARED))
+            return realloc(block, size);
+        if (block == nullptr)
+            return shared_alloc(size);
+        assert(shared_of(block) -> refs.load(std::memory_order_relaxed) == 1);
+        h = (shared_header*)realloc(shared_of(block), sizeof(shared_header) + size);
+        return h + 1;
+    }
+
+    static void block_retain(const value *v) {
+        void *block;
+        if (v -> flags & VALUE_SHARED && (block = value_block(v)) != nullptr)
+            shared_of(block) -> refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
     void fre(value *v) {
+        void *block;
         assert(v != nullptr);
+        if (v -> flags & VALUE_SHARED && (block = value_block(v)) != nullptr &&
+            shared_of(block) -> refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            v -> type = NUL; // still referenced by another document
+            v -> flags = 0;
+            return;
+        }
+
         if (v -> type == STRING) {
-            free(v -> u.s.s);
+            if (!(v -> flags & VALUE_INLINE_STRING))
+                block_free(v, v -> u.s.s);
         } else if (v -> type == ARRAY) {
             for (size_t i = 0; i < v -> u.a.size; i++) {
                 fre(&v -> u.a.e[i]);
             }
 
-            free(v -> u.a.e);
+            block_free(v, v -> u.a.e);
         } else if (v -> type == OBJECT) {
             for (size_t i = 0; i < v -> u.o.size; i++) {
-                free(v -> u.o.m[i].k);
+                free_member_key(&v -> u.o.m[i]);
                 fre(&v -> u.o.m[i].v);
             }
-            free(v -> u.o.m);
+            block_free(v, v -> u.o.m);
         }
         v -> type = NUL;
+        v -> flags = 0;
     }
 
     const char* get_string(const value* v) {
         assert(v != nullptr && v -> type == STRING);
-        return v -> u.s.s;
+        return v -> flags & VALUE_INLINE_STRING ? v -> u.ss : v -> u.s.s;
     }
 
     size_t get_string_length(const value* v) {
         assert(v != nullptr && v -> type == STRING);
+        if (v -> flags & VALUE_INLINE_STRING)
+            return INLINE_STRING_CAPACITY - 1 - v -> u.ss[INLINE_STRING_CAPACITY - 1];
         return v -> u.s.len;
     }
 
     void set_string(value *v, const char *s, size_t len) {
         assert(v != nullptr && (s != nullptr || len == 0));
         fre(v);
-        v -> u.s.s = new char[len + 1];
-        memcpy(v -> u.s.s, s, len);
-        v -> u.s.s[len] = '\0';
-        v -> u.s.len = len;
+        if (len < INLINE_STRING_CAPACITY) {
+            v -> u.ss[INLINE_STRING_CAPACITY - 1] = (char)(INLINE_STRING_CAPACITY - 1 - len);
+            if (len) memcpy(v -> u.ss, s, len);
+            v -> u.ss[len] = '\0';
+            v -> flags = VALUE_INLINE_STRING;
+        } else {
+            v -> u.s.s = (char*)malloc(len + 1);
+            memcpy(v -> u.s.s, s, len);
+            v -> u.s.s[len] = '\0';
+            v -> u.s.len = len;
+        }
         v -> type = STRING;
     }
 
@@ -421,7 +995,7 @@ namespace lept {
     const char* get_object_key(const value* v, size_t index) {
         assert(v != nullptr && v -> type == OBJECT);
         assert(index < v -> u.o.size);
-        return v -> u.o.m[index].k;
+        return member_key(&v -> u.o.m[index]);
     }
 
     size_t get_object_key_length(const value* v, size_t index) {
@@ -442,7 +1016,992 @@ namespace lept {
 
     double get_number(const value *v) {
         assert(v != nullptr && v -> type == NUMBER);
-        return v -> u.n;
+        if (std::isnan(v -> u.n.d)) // lazily parsed, convert once and cache
+            ((value*)v) -> u.n.d = strtod(v -> u.n.raw, nullptr);
+        return v -> u.n.d;
+    }
+
+    const char* get_number_raw(const value *v, size_t *len) {
+        const char *p;
+        assert(v != nullptr && v -> type == NUMBER && len != nullptr);
+        if ((p = v -> u.n.raw) == nullptr) {
+            *len = 0;
+            return nullptr;
+        }
+
+        // the text was validated by parse_number, so it ends at the first non-number character
+        while (ISDIGIT(*p) || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')
+            p++;
+        *len = p - v -> u.n.raw;
+        return v -> u.n.raw;
+    }
+
+    int is_equal(const value *lhs, const value *rhs) {
+        assert(lhs != nullptr && rhs != nullptr);
+        if (lhs == rhs) return 1;
+        if (lhs -> type != rhs -> type) return 0;
+        switch (lhs -> type) {
+            case STRING:
+                return get_string_length(lhs) == get_string_length(rhs) &&
+                       memcmp(get_string(lhs), get_string(rhs), get_string_length(lhs)) == 0;
+            case NUMBER:
+                return get_number(lhs) == get_number(rhs);
+            case ARRAY:
+                if (lhs -> u.a.size != rhs -> u.a.size) return 0;
+                for (size_t i = 0; i < lhs -> u.a.size; i++) {
+                    if (!is_equal(&lhs -> u.a.e[i], &rhs -> u.a.e[i]))
+                        return 0;
+                }
+                return 1;
+            case OBJECT: // member order does not matter
+                if (lhs -> u.o.size != rhs -> u.o.size) return 0;
+                for (size_t i = 0; i < lhs -> u.o.size; i++) {
+                    size_t j = find_member(rhs, &lhs -> u.o.m[i], i);
+                    if (j == KEY_NOT_EXIST || !is_equal(&lhs -> u.o.m[i].v, &rhs -> u.o.m[j].v))
+                        return 0;
+                }
+                return 1;
+            default:
+                return 1;
+        }
+    }
+
+    void copy(value *dst, const value *src) {
+        assert(dst != nullptr && src != nullptr && dst != src);
+        switch (src -> type) {
+            case STRING:
+                set_string(dst, get_string(src), get_string_length(src));
+                break;
+            case ARRAY: {
+                size_t size = src -> u.a.size;
+                fre(dst);
+                dst -> u.a.e = size ? (value*)malloc(size * sizeof(value)) : nullptr;
+                for (size_t i = 0; i < size; i++) {
+                    dst -> u.a.e[i] = value();
+                    copy(&dst -> u.a.e[i], &src -> u.a.e[i]);
+                }
+                dst -> u.a.size = size;
+                dst -> type = ARRAY;
+                break;
+            }
+            case OBJECT: {
+                size_t size = src -> u.o.size;
+                fre(dst);
+                dst -> u.o.m = size ? (member*)malloc(size * sizeof(member)) : nullptr;
+                for (size_t i = 0; i < size; i++) {
+                    member *m = &dst -> u.o.m[i];
+                    const member *sm = &src -> u.o.m[i];
+                    set_member_key(m, member_key(sm), sm -> kLen);
+                    m -> v = value();
+                    copy(&m -> v, &sm -> v);
+                }
+                dst -> u.o.size = size;
+                dst -> type = OBJECT;
+                break;
+            }
+            default:
+                fre(dst);
+                memcpy(dst, src, sizeof(value));
+                break;
+        }
+    }
+
+    void move(value *dst, value *src) {
+        assert(dst != nullptr && src != nullptr && dst != src);
+        fre(dst);
+        memcpy(dst, src, sizeof(value));
+        src -> type = NUL;
+        src -> flags = 0;
+    }
+
+    void swap(value *lhs, value *rhs) {
+        assert(lhs != nullptr && rhs != nullptr);
+        if (lhs != rhs) {
+            value temp;
+            memcpy(&temp, lhs, sizeof(value));
+            memcpy(lhs, rhs, sizeof(value));
+            memcpy(rhs, &temp, sizeof(value));
+        }
+    }
+
+    size_t find_object_index(const value *v, const char *key, size_t kLen) {
+        assert(v != nullptr && v -> type == OBJECT && key != nullptr);
+        for (size_t i = 0; i < v -> u.o.size; i++) {
+            if (v -> u.o.m[i].kLen == kLen && memcmp(member_key(&v -> u.o.m[i]), key, kLen) == 0)
+                return i;
+        }
+        return KEY_NOT_EXIST;
+    }
+
+    value* find_object_value(const value *v, const char *key, size_t kLen) {
+        size_t index = find_object_index(v, key, kLen);
+        return index != KEY_NOT_EXIST ? &v -> u.o.m[index].v : nullptr;
+    }
+
+    /* mutation helpers for the patch functions, new slots are null */
+
+    static value* insert_array_element(value *v, size_t index) {
+        assert(v != nullptr && v -> type == ARRAY && index <= v -> u.a.size);
+        value *e = (value*)block_realloc(v, v -> u.a.e, (v -> u.a.size + 1) * sizeof(value));
+        memmove(e + index + 1, e + index, (v -> u.a.size - index) * sizeof(value));
+        e[index] = value();
+        v -> u.a.e = e;
+        v -> u.a.size++;
+        return &e[index];
+    }
+
+    static void erase_array_element(value *v, size_t index) {
+        assert(v != nullptr && v -> type == ARRAY && index < v -> u.a.size);
+        fre(&v -> u.a.e[index]);
+        memmove(v -> u.a.e + index, v -> u.a.e + index + 1, (v -> u.a.size - index - 1) * sizeof(value));
+        v -> u.a.size--;
+    }
+
+    static value* set_object_value(value *v, const char *key, size_t kLen) {
+        value *found;
+        member *m;
+        assert(v != nullptr && v -> type == OBJECT && key != nullptr);
+        if ((found = find_object_value(v, key, kLen)) != nullptr)
+            return found;
+
+        v -> u.o.m = (member*)block_realloc(v, v -> u.o.m, (v -> u.o.size + 1) * sizeof(member));
+        m = &v -> u.o.m[v -> u.o.size++];
+        set_member_key(m, key, kLen);
+        m -> v = value();
+        return &m -> v;
+    }
+
+    static void remove_object_value(value *v, size_t index) {
+        assert(v != nullptr && v -> type == OBJECT && index < v -> u.o.size);
+        free_member_key(&v -> u.o.m[index]);
+        fre(&v -> u.o.m[index].v);
+        memmove(v -> u.o.m + index, v -> u.o.m + index + 1, (v -> u.o.size - index - 1) * sizeof(member));
+        v -> u.o.size--;
+    }
+
+    static void set_object(value *v) {
+        fre(v);
+        v -> u.o.m = nullptr;
+        v -> u.o.size = 0;
+        v -> type = OBJECT;
+    }
+
+    /* copy-on-write helpers, every heap block below a document root is shared */
+
+    // moves the heap storage of an owned tree into shared blocks
+    static void freeze_value(value *v) {
+        void *block;
+        if (v -> flags & VALUE_SHARED)
+            return; // already frozen with everything below it
+        switch (v -> type) {
+            case NUMBER:
+                get_number(v); // readers must not race on the lazy conversion
+                v -> u.n.raw = nullptr; // the input may not outlive the document
+                return;
+            case STRING:
+                if (v -> flags & VALUE_INLINE_STRING)
+                    return;
+                memcpy(block = shared_alloc(v -> u.s.len + 1), v -> u.s.s, v -> u.s.len + 1);
+                free(v -> u.s.s);
+                v -> u.s.s = (char*)block;
+                break;
+            case ARRAY:
+                for (size_t i = 0; i < v -> u.a.size; i++)
+                    freeze_value(&v -> u.a.e[i]);
+                if (v -> u.a.size) {
+                    memcpy(block = shared_alloc(v -> u.a.size * sizeof(value)), v -> u.a.e, v -> u.a.size * sizeof(value));
+                    free(v -> u.a.e);
+                    v -> u.a.e = (value*)block;
+                }
+                break;
+            case OBJECT:
+                for (size_t i = 0; i < v -> u.o.size; i++)
+                    freeze_value(&v -> u.o.m[i].v);
+                if (v -> u.o.size) {
+                    memcpy(block = shared_alloc(v -> u.o.size * sizeof(member)), v -> u.o.m, v -> u.o.size * sizeof(member));
+                    free(v -> u.o.m);
+                    v -> u.o.m = (member*)block;
+                }
+                break;
+            default:
+                return;
+        }
+        v -> flags |= VALUE_SHARED; // also set on empty containers so they grow into shared blocks
+    }
+
+    // gives v a private copy of its container block, the children stay shared
+    static void unshare_value(value *v) {
+        value old;
+        void *block;
+        if (!(v -> flags & VALUE_SHARED) || (v -> type != ARRAY && v -> type != OBJECT) ||
+            (block = value_block(v)) == nullptr || shared_of(block) -> refs.load(std::memory_order_acquire) == 1)
+            return;
+
+        memcpy(&old, v, sizeof(value));
+        if (v -> type == ARRAY) {
+            memcpy(v -> u.a.e = (value*)shared_alloc(v -> u.a.size * sizeof(value)), old.u.a.e, v -> u.a.size * sizeof(value));
+            for (size_t i = 0; i < v -> u.a.size; i++)
+                block_retain(&v -> u.a.e[i]);
+        } else {
+            memcpy(v -> u.o.m = (member*)shared_alloc(v -> u.o.size * sizeof(member)), old.u.o.m, v -> u.o.size * sizeof(member));
+            for (size_t i = 0; i < v -> u.o.size; i++) {
+                set_member_key(&v -> u.o.m[i], member_key(&old.u.o.m[i]), old.u.o.m[i].kLen); // keys belong to the block
+                block_retain(&v -> u.o.m[i].v);
+            }
+        }
+        fre(&old); // drops this reference to the old block only
+    }
+
+    /*
+     * diff: both trees are hashed once into mirror trees, so a subtree whose hash
+     * differs is known to have changed without walking it. Equal hashes are
+     * confirmed with is_equal where the walk stops descending, so each skipped
+     * subtree is compared once and a collision never drops a change.
+     */
+
+    struct hash_node {
+        uint64_t h = 0;
+        hash_node *kids = nullptr; // parallel to array elements / object members
+    };
+
+    static uint64_t hash_finalize(uint64_t x) { // splitmix64
+        x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t hash_mix(uint64_t h, uint64_t x) { // order dependent, equal neighbours do not cancel
+        return hash_finalize(h * 0x9E3779B97F4A7C15ULL + x);
+    }
+
+    static uint64_t hash_bytes(const char *s, size_t len) { // FNV-1a
+        uint64_t h = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char)s[i];
+            h *= 0x100000001B3ULL;
+        }
+        return h;
+    }
+
+    static void hash_build(hash_node *hn, const value *v) {
+        uint64_t h = hash_finalize(0x9E3779B97F4A7C15ULL * ((uint64_t)v -> type + 1)); // non-zero seed per type
+        hn -> kids = nullptr;
+        switch (v -> type) {
+            case NUMBER: {
+                double n = get_number(v);
+                uint64_t bits;
+                if (n == 0.0) n = 0.0; // -0 equals 0
+                memcpy(&bits, &n, sizeof(bits));
+                h = hash_mix(h, bits);
+                break;
+            }
+            case STRING:
+                h = hash_mix(h, hash_bytes(get_string(v), get_string_length(v)));
+                break;
+            case ARRAY:
+                hn -> kids = v -> u.a.size ? (hash_node*)malloc(v -> u.a.size * sizeof(hash_node)) : nullptr;
+                for (size_t i = 0; i < v -> u.a.size; i++) {
+                    hash_build(&hn -> kids[i], &v -> u.a.e[i]);
+                    h = hash_mix(h, hn -> kids[i].h);
+                }
+                h = hash_mix(h, v -> u.a.size);
+                break;
+            case OBJECT: {
+                uint64_t sum = 0; // commutative, member order does not matter
+                hn -> kids = v -> u.o.size ? (hash_node*)malloc(v -> u.o.size * sizeof(hash_node)) : nullptr;
+                for (size_t i = 0; i < v -> u.o.size; i++) {
+                    hash_build(&hn -> kids[i], &v -> u.o.m[i].v);
+                    sum += hash_mix(hash_bytes(member_key(&v -> u.o.m[i]), v -> u.o.m[i].kLen), hn -> kids[i].h);
+                }
+                h = hash_mix(hash_mix(h, sum), v -> u.o.size);
+                break;
+            }
+            default:
+                break;
+        }
+        hn -> h = h;
+    }
+
+    static void hash_free(hash_node *hn, const value *v) {
+        if (v -> type == ARRAY) {
+            for (size_t i = 0; i < v -> u.a.size; i++)
+                hash_free(&hn -> kids[i], &v -> u.a.e[i]);
+        } else if (v -> type == OBJECT) {
+            for (size_t i = 0; i < v -> u.o.size; i++)
+                hash_free(&hn -> kids[i], &v -> u.o.m[i].v);
+        }
+        free(hn -> kids);
+    }
+
+    struct diff_context {
+        context path; // JSON Pointer of the current node, not terminated
+        context ops;  // stack of emitted operation values
+    };
+
+    // different hashes prove a change, equal ones are confirmed before the subtree is skipped
+    static int diff_same(const value *a, const hash_node *ha, const value *b, const hash_node *hb) {
+        return ha -> h == hb -> h && is_equal(a, b);
+    }
+
+    static void diff_push_token(context *c, const char *s, size_t len) {
+        PUTC(c, '/');
+        for (size_t i = 0; i < len; i++) {
+            if (s[i] == '~') { PUTC(c, '~'); PUTC(c, '0'); }
+            else if (s[i] == '/') { PUTC(c, '~'); PUTC(c, '1'); }
+            else PUTC(c, s[i]);
+        }
+    }
+
+    static void diff_push_index(context *c, size_t index) {
+        char buffer[24];
+        char *p = buffer + sizeof(buffer);
+        do { *--p = (char)('0' + index % 10); } while (index /= 10);
+        diff_push_token(c, p, buffer + sizeof(buffer) - p);
+    }
+
+    static void diff_emit(diff_context *dc, const char *op, const value *val) {
+        value o;
+        set_object(&o);
+        set_string(set_object_value(&o, "op", 2), op, strlen(op));
+        set_string(set_object_value(&o, "path", 4), dc -> path.top ? dc -> path.stack : "", dc -> path.top);
+        if (val != nullptr)
+            copy(set_object_value(&o, "value", 5), val);
+        memcpy(context_push(&dc -> ops, sizeof(value)), &o, sizeof(value));
+    }
+
+    // a and b are known to differ
+    static void diff_value(diff_context *dc, const value *a, const hash_node *ha, const value *b, const hash_node *hb) {
+        size_t top = dc -> path.top;
+
+        if (a -> type == OBJECT && b -> type == OBJECT) {
+            for (size_t i = 0; i < a -> u.o.size; i++) {
+                const member *m = &a -> u.o.m[i];
+                size_t j = find_member(b, m, i);
+                if (j != KEY_NOT_EXIST && diff_same(&m -> v, &ha -> kids[i], &b -> u.o.m[j].v, &hb -> kids[j]))
+                    continue;
+                diff_push_token(&dc -> path, member_key(m), m -> kLen);
+                if (j == KEY_NOT_EXIST)
+                    diff_emit(dc, "remove", nullptr);
+                else
+                    diff_value(dc, &m -> v, &ha -> kids[i], &b -> u.o.m[j].v, &hb -> kids[j]);
+                dc -> path.top = top;
+            }
+            for (size_t j = 0; j < b -> u.o.size; j++) {
+                const member *m = &b -> u.o.m[j];
+                if (find_member(a, m, j) == KEY_NOT_EXIST) {
+                    diff_push_token(&dc -> path, member_key(m), m -> kLen);
+                    diff_emit(dc, "add", &m -> v);
+                    dc -> path.top = top;
+                }
+            }
+        } else if (a -> type == ARRAY && b -> type == ARRAY) {
+            size_t la = a -> u.a.size, lb = b -> u.a.size, head = 0, i;
+            // common prefix and suffix are left untouched
+            while (head < la && head < lb &&
+                   diff_same(&a -> u.a.e[head], &ha -> kids[head], &b -> u.a.e[head], &hb -> kids[head]))
+                head++;
+            while (la > head && lb > head &&
+                   diff_same(&a -> u.a.e[la - 1], &ha -> kids[la - 1], &b -> u.a.e[lb - 1], &hb -> kids[lb - 1]))
+                la--, lb--;
+
+            for (i = head; i < la && i < lb; i++) {
+                if (i > head && diff_same(&a -> u.a.e[i], &ha -> kids[i], &b -> u.a.e[i], &hb -> kids[i]))
+                    continue; // head is already known to differ
+                diff_push_index(&dc -> path, i);
+                diff_value(dc, &a -> u.a.e[i], &ha -> kids[i], &b -> u.a.e[i], &hb -> kids[i]);
+                dc -> path.top = top;
+            }
+            for (; la > i; la--) { // each removal shifts the next surplus element into i
+                diff_push_index(&dc -> path, i);
+                diff_emit(dc, "remove", nullptr);
+                dc -> path.top = top;
+            }
+            for (; i < lb; i++) {
+                diff_push_index(&dc -> path, i);
+                diff_emit(dc, "add", &b -> u.a.e[i]);
+                dc -> path.top = top;
+            }
+        } else {
+            diff_emit(dc, "replace", b);
+        }
+    }
+
+    void diff(value *patch, const value *a, const value *b) {
+        diff_context dc;
+        hash_node ha, hb;
+        size_t size;
+        assert(patch != nullptr && a != nullptr && b != nullptr);
+        assert(patch != a && patch != b);
+
+        hash_build(&ha, a);
+        hash_build(&hb, b);
+        if (!diff_same(a, &ha, b, &hb))
+            diff_value(&dc, a, &ha, b, &hb);
+        hash_free(&ha, a);
+        hash_free(&hb, b);
+
+        fre(patch);
+        size = dc.ops.top / sizeof(value);
+        patch -> type = ARRAY;
+        patch -> u.a.size = size;
+        patch -> u.a.e = nullptr;
+        if (size)
+            memcpy(patch -> u.a.e = (value*)malloc(size * sizeof(value)), context_pop(&dc.ops, size * sizeof(value)), size * sizeof(value));
+        free(dc.path.stack);
+        free(dc.ops.stack);
+    }
+
+    /* apply_patch: JSON Pointer (RFC 6901) resolution */
+
+    struct pointer {
+        value *parent = nullptr;   // nullptr when the pointer refers to the whole document
+        const char *key = nullptr; // last reference token, unescaped
+        size_t kLen = 0;
+    };
+
+    static int pointer_index(const char *key, size_t kLen, size_t *index) {
+        if (kLen == 0 || (key[0] == '0' && kLen > 1))
+            return 0;
+        *index = 0;
+        for (size_t i = 0; i < kLen; i++) {
+            if (!ISDIGIT(key[i]) || *index > (KEY_NOT_EXIST - 9) / 10)
+                return 0;
+            *index = *index * 10 + (key[i] - '0');
+        }
+        return 1;
+    }
+
+    static value* pointer_child(const value *v, const char *key, size_t kLen) {
+        size_t index;
+        if (v -> type == OBJECT)
+            return find_object_value(v, key, kLen);
+        if (v -> type == ARRAY && pointer_index(key, kLen, &index) && index < v -> u.a.size)
+            return &v -> u.a.e[index];
+        return nullptr;
+    }
+
+    static value* pointer_get(value *root, const pointer *ptr) {
+        return ptr -> parent ? pointer_child(ptr -> parent, ptr -> key, ptr -> kLen) : root;
+    }
+
+    // the unescaped last token lives in c -> stack until the next resolve,
+    // containers along the path are unshared only when the target will be written
+    static int pointer_resolve(context *c, value *root, const value *path, pointer *ptr, int write) {
+        const char *p, *end;
+        value *cur = root;
+        if (path == nullptr || path -> type != STRING)
+            return PATCH_INVALID_OPERATION;
+
+        p = get_string(path);
+        end = p + get_string_length(path);
+        ptr -> parent = nullptr;
+        if (p != end && *p != '/')
+            return PATCH_INVALID_POINTER;
+
+        while (p < end) {
+            if (ptr -> parent != nullptr && (cur = pointer_child(ptr -> parent, ptr -> key, ptr -> kLen)) == nullptr)
+                return PATCH_PATH_NOT_FOUND;
+            if (write && c -> flags & CONTEXT_COPY_ON_WRITE)
+                unshare_value(cur);
+            c -> top = 0;
+            for (p++; p < end && *p != '/'; p++) {
+                if (*p != '~') PUTC(c, *p);
+                else if (p + 1 < end && p[1] == '0') { PUTC(c, '~'); p++; }
+                else if (p + 1 < end && p[1] == '1') { PUTC(c, '/'); p++; }
+                else return PATCH_INVALID_POINTER;
+            }
+            ptr -> parent = cur;
+            ptr -> key = c -> top ? c -> stack : ""; // "/" names the "" member, the stack may be unallocated
+            ptr -> kLen = c -> top;
+        }
+        if (ptr -> parent != nullptr && ptr -> parent -> type != OBJECT && ptr -> parent -> type != ARRAY)
+            return PATCH_PATH_NOT_FOUND;
+        return PATCH_OK;
+    }
+
+    // moves val into the location, val becomes null
+    static int pointer_add(value *root, const pointer *ptr, value *val) {
+        size_t index;
+        value *parent = ptr -> parent;
+        if (parent == nullptr)
+            move(root, val);
+        else if (parent -> type == OBJECT)
+            move(set_object_value(parent, ptr -> key, ptr -> kLen), val);
+        else if (ptr -> kLen == 1 && ptr -> key[0] == '-')
+            move(insert_array_element(parent, parent -> u.a.size), val);
+        else if (!pointer_index(ptr -> key, ptr -> kLen, &index) || index > parent -> u.a.size)
+            return PATCH_PATH_NOT_FOUND;
+        else
+            move(insert_array_element(parent, index), val);
+        return PATCH_OK;
+    }
+
+    // moves the target into out (if given) before removing it
+    static int pointer_remove(const pointer *ptr, value *out) {
+        size_t index;
+        value *parent = ptr -> parent;
+        if (parent == nullptr)
+            return PATCH_INVALID_POINTER;
+
+        if (parent -> type == OBJECT)
+            index = find_object_index(parent, ptr -> key, ptr -> kLen);
+        else if (!pointer_index(ptr -> key, ptr -> kLen, &index) || index >= parent -> u.a.size)
+            index = KEY_NOT_EXIST;
+        if (index == KEY_NOT_EXIST)
+            return PATCH_PATH_NOT_FOUND;
+
+        if (parent -> type == OBJECT) {
+            if (out != nullptr) move(out, &parent -> u.o.m[index].v);
+            remove_object_value(parent, index);
+        } else {
+            if (out != nullptr) move(out, &parent -> u.a.e[index]);
+            erase_array_element(parent, index);
+        }
+        return PATCH_OK;
+    }
+
+    static int apply_operation(context *c, value *root, const value *op) {
+        const value *name, *path, *from, *val;
+        value temp;
+        pointer ptr;
+        int ret;
+
+        if (op -> type != OBJECT || (name = find_object_value(op, "op", 2)) == nullptr || name -> type != STRING)
+            return PATCH_INVALID_OPERATION;
+        path = find_object_value(op, "path", 4);
+        from = find_object_value(op, "from", 4);
+        val = find_object_value(op, "value", 5);
+
+#define OP_IS(s) (get_string_length(name) == sizeof(s) - 1 && memcmp(get_string(name), s, sizeof(s) - 1) == 0)
+        if (OP_IS("add")) {
+            if (val == nullptr) return PATCH_INVALID_OPERATION;
+            if ((ret = pointer_resolve(c, root, path, &ptr, 1)) != PATCH_OK) return ret;
+            copy(&temp, val);
+            if (c -> flags & CONTEXT_COPY_ON_WRITE) freeze_value(&temp);
+            ret = pointer_add(root, &ptr, &temp);
+        } else if (OP_IS("remove")) {
+            if ((ret = pointer_resolve(c, root, path, &ptr, 1)) != PATCH_OK) return ret;
+            ret = pointer_remove(&ptr, nullptr);
+        } else if (OP_IS("replace")) {
+            value *target;
+            if (val == nullptr) return PATCH_INVALID_OPERATION;
+            if ((ret = pointer_resolve(c, root, path, &ptr, 1)) != PATCH_OK) return ret;
+            if ((target = pointer_get(root, &ptr)) == nullptr) return PATCH_PATH_NOT_FOUND;
+            copy(&temp, val);
+            if (c -> flags & CONTEXT_COPY_ON_WRITE) freeze_value(&temp);
+            move(target, &temp);
+        } else if (OP_IS("move")) {
+            size_t fLen;
+            if (from == nullptr || from -> type != STRING || path == nullptr || path -> type != STRING)
+                return PATCH_INVALID_OPERATION;
+            fLen = get_string_length(from);
+            if (get_string_length(path) > fLen && get_string(path)[fLen] == '/' &&
+                memcmp(get_string(path), get_string(from), fLen) == 0)
+                return PATCH_INVALID_POINTER; // a value cannot be moved into one of its children
+            if ((ret = pointer_resolve(c, root, from, &ptr, 1)) != PATCH_OK) return ret;
+            if (ptr.parent == nullptr) { // moving the whole document onto itself or a child
+                return get_string_length(path) == 0 ? PATCH_OK : PATCH_INVALID_POINTER;
+            }
+            if ((ret = pointer_remove(&ptr, &temp)) != PATCH_OK) return ret;
+            if ((ret = pointer_resolve(c, root, path, &ptr, 1)) == PATCH_OK)
+                ret = pointer_add(root, &ptr, &temp);
+        } else if (OP_IS("copy")) {
+            value *source;
+            if ((ret = pointer_resolve(c, root, from, &ptr, 0)) != PATCH_OK) return ret;
+            if ((source = pointer_get(root, &ptr)) == nullptr) return PATCH_PATH_NOT_FOUND;
+            if (c -> flags & CONTEXT_COPY_ON_WRITE) { // share the subtree instead of copying it
+                memcpy(&temp, source, sizeof(value));
+                block_retain(&temp);
+            } else {
+                copy(&temp, source);
+            }
+            if ((ret = pointer_resolve(c, root, path, &ptr, 1)) == PATCH_OK)
+                ret = pointer_add(root, &ptr, &temp);
+        } else if (OP_IS("test")) {
+            value *target;
+            if (val == nullptr) return PATCH_INVALID_OPERATION;
+            if ((ret = pointer_resolve(c, root, path, &ptr, 0)) != PATCH_OK) return ret;
+            if ((target = pointer_get(root, &ptr)) == nullptr) return PATCH_PATH_NOT_FOUND;
+            ret = is_equal(target, val) ? PATCH_OK : PATCH_TEST_FAILED;
+        } else {
+            ret = PATCH_INVALID_OPERATION;
+        }
+#undef OP_IS
+        fre(&temp);
+        return ret;
+    }
+
+    static int apply_operations(context *c, value *v, const value *patch) {
+        int ret = PATCH_OK;
+        if (patch -> type != ARRAY)
+            return PATCH_INVALID_OPERATION;
+
+        for (size_t i = 0; i < patch -> u.a.size && ret == PATCH_OK; i++)
+            ret = apply_operation(c, v, &patch -> u.a.e[i]);
+        free(c -> stack);
+        c -> stack = nullptr;
+        return ret;
+    }
+
+    int apply_patch(value *v, const value *patch) {
+        context c;
+        assert(v != nullptr && patch != nullptr && v != patch);
+        return apply_operations(&c, v, patch);
+    }
+
+    void merge_patch(value *target, const value *patch) {
+        assert(target != nullptr && patch != nullptr && target != patch);
+        if (patch -> type != OBJECT) {
+            copy(target, patch);
+            return;
+        }
+
+        if (target -> type != OBJECT)
+            set_object(target);
+        for (size_t i = 0; i < patch -> u.o.size; i++) {
+            const member *m = &patch -> u.o.m[i];
+            if (m -> v.type == NUL) {
+                size_t index = find_object_index(target, member_key(m), m -> kLen);
+                if (index != KEY_NOT_EXIST)
+                    remove_object_value(target, index);
+            } else {
+                merge_patch(set_object_value(target, member_key(m), m -> kLen), &m -> v);
+            }
+        }
+    }
+
+    /* streaming writer */
+
+    enum {
+        WRITER_ROOT_EMPTY = 0,
+        WRITER_ROOT_DONE,
+        WRITER_ARRAY_FIRST,
+        WRITER_ARRAY_NEXT,
+        WRITER_OBJECT_FIRST_KEY,
+        WRITER_OBJECT_NEXT_KEY,
+        WRITER_OBJECT_VALUE,
+    };
+
+    // 'u' means \u00XX, any other non-zero entry is the character after the backslash
+    static const char escape_table[256] = {
+        'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+        'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+          0,  0,'"',  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+        ESCAPE_ROW_NONE, ESCAPE_ROW_NONE,
+          0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,'\\', 0,  0,  0,
+        ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE,
+        ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE, ESCAPE_ROW_NONE,
+    };
+
+    // non-zero if any of the 8 bytes at p is a control character, '"' or '\\'
+    static uint64_t needs_escape8(const char *p) {
+        const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        return ((x - ones * 0x20) | ((x ^ (ones * '"')) - ones) | ((x ^ (ones * '\\')) - ones)) & ~x & highs;
+    }
+
+    static int write_fd(void *user, const char *data, size_t len) {
+        int fd = ((writer*)user) -> fd;
+        while (len > 0) {
+            long n = (long)write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            data += n;
+            len -= (size_t)n;
+        }
+        return 0;
+    }
+
+    static void writer_flush(writer *w) {
+        if (w -> len > 0 && w -> error == WRITE_OK && w -> out(w -> user, w -> buffer, w -> len) != 0)
+            w -> error = WRITE_IO_ERROR;
+        w -> len = 0;
+    }
+
+    static void writer_put(writer *w, const char *s, size_t len) {
+        if (w -> len + len > WRITER_BUFFER_SIZE) {
+            writer_flush(w);
+            if (len >= WRITER_BUFFER_SIZE) { // too big to be worth buffering
+                if (w -> error == WRITE_OK && w -> out(w -> user, s, len) != 0)
+                    w -> error = WRITE_IO_ERROR;
+                return;
+            }
+        }
+        memcpy(w -> buffer + w -> len, s, len);
+        w -> len += len;
+    }
+
+    static void writer_putc(writer *w, char ch) {
+        if (w -> len == WRITER_BUFFER_SIZE)
+            writer_flush(w);
+        w -> buffer[w -> len++] = ch;
+    }
+
+    static void writer_put_string(writer *w, const char *s, size_t len) {
+        static const char hex[] = "0123456789ABCDEF";
+        const char *p = s, *run = s, *end = s + len;
+        writer_putc(w, '"');
+        while (p < end) {
+            if (end - p >= 8 && !needs_escape8(p)) {
+                p += 8;
+                continue;
+            }
+            unsigned char ch = (unsigned char)*p;
+            if (!escape_table[ch]) {
+                p++;
+                continue;
+            }
+
+            writer_put(w, run, p - run);
+            if (escape_table[ch] == 'u') {
+                char buffer[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15] };
+                writer_put(w, buffer, sizeof(buffer));
+            } else {
+                char buffer[2] = { '\\', escape_table[ch] };
+                writer_put(w, buffer, sizeof(buffer));
+            }
+            run = ++p;
+        }
+        writer_put(w, run, end - run);
+        writer_putc(w, '"');
+    }
+
+    // advances the state of the enclosing container for a new value
+    static int writer_prefix(writer *w) {
+        unsigned char *state = &w -> state[w -> depth];
+        if (w -> error != WRITE_OK)
+            return w -> error;
+        switch (*state) {
+            case WRITER_ROOT_EMPTY: *state = WRITER_ROOT_DONE; break;
+            case WRITER_ARRAY_FIRST: *state = WRITER_ARRAY_NEXT; break;
+            case WRITER_ARRAY_NEXT: writer_putc(w, ','); break;
+            case WRITER_OBJECT_VALUE: *state = WRITER_OBJECT_NEXT_KEY; break;
+            default: return w -> error = WRITE_INVALID_STATE;
+        }
+        return WRITE_OK;
+    }
+
+    static void writer_init(writer *w) {
+        w -> error = WRITE_OK;
+        w -> depth = 0;
+        w -> len = 0;
+        w -> state[0] = WRITER_ROOT_EMPTY;
+    }
+
+    void writer_init_fd(writer *w, int fd) {
+        assert(w != nullptr && fd >= 0);
+        writer_init(w);
+        w -> out = write_fd;
+        w -> user = w;
+        w -> fd = fd;
+    }
+
+    void writer_init_callback(writer *w, write_func out, void *user) {
+        assert(w != nullptr && out != nullptr);
+        writer_init(w);
+        w -> out = out;
+        w -> user = user;
+        w -> fd = -1;
+    }
+
+    static int writer_start(writer *w, char ch, unsigned char state) {
+        assert(w != nullptr);
+        if (writer_prefix(w) != WRITE_OK)
+            return w -> error;
+        if (w -> depth == WRITER_MAX_DEPTH)
+            return w -> error = WRITE_TOO_DEEP;
+        w -> state[++w -> depth] = state;
+        writer_putc(w, ch);
+        return w -> error;
+    }
+
+    static int writer_end(writer *w, char ch, unsigned char first, unsigned char next) {
+        assert(w != nullptr);
+        if (w -> error != WRITE_OK)
+            return w -> error;
+        if (w -> depth == 0 || (w -> state[w -> depth] != first && w -> state[w -> depth] != next))
+            return w -> error = WRITE_INVALID_STATE;
+        w -> depth--;
+        writer_putc(w, ch);
+        return w -> error;
+    }
+
+    int writer_start_object(writer *w) {
+        return writer_start(w, '{', WRITER_OBJECT_FIRST_KEY);
+    }
+
+    int writer_end_object(writer *w) {
+        return writer_end(w, '}', WRITER_OBJECT_FIRST_KEY, WRITER_OBJECT_NEXT_KEY);
+    }
+
+    int writer_start_array(writer *w) {
+        return writer_start(w, '[', WRITER_ARRAY_FIRST);
+    }
+
+    int writer_end_array(writer *w) {
+        return writer_end(w, ']', WRITER_ARRAY_FIRST, WRITER_ARRAY_NEXT);
+    }
+
+    int writer_key(writer *w, const char *k, size_t len) {
+        unsigned char *state;
+        assert(w != nullptr && (k != nullptr || len == 0));
+        if (w -> error != WRITE_OK)
+            return w -> error;
+        state = &w -> state[w -> depth];
+        if (*state == WRITER_OBJECT_NEXT_KEY)
+            writer_putc(w, ',');
+        else if (*state != WRITER_OBJECT_FIRST_KEY)
+            return w -> error = WRITE_INVALID_STATE;
+        *state = WRITER_OBJECT_VALUE;
+        writer_put_string(w, k, len);
+        writer_putc(w, ':');
+        return w -> error;
+    }
+
+    int writer_null(writer *w) {
+        assert(w != nullptr);
+        if (writer_prefix(w) == WRITE_OK)
+            writer_put(w, "null", 4);
+        return w -> error;
+    }
+
+    int writer_boolean(writer *w, int b) {
+        assert(w != nullptr);
+        if (writer_prefix(w) == WRITE_OK) {
+            if (b) writer_put(w, "true", 4);
+            else writer_put(w, "false", 5);
+        }
+        return w -> error;
+    }
+
+    int writer_number(writer *w, double n) {
+        char buffer[32];
+        assert(w != nullptr);
+        if (w -> error == WRITE_OK && !std::isfinite(n))
+            return w -> error = WRITE_INVALID_NUMBER;
+        if (writer_prefix(w) == WRITE_OK)
+            writer_put(w, buffer, snprintf(buffer, sizeof(buffer), "%.17g", n));
+        return w -> error;
+    }
+
+    int writer_string(writer *w, const char *s, size_t len) {
+        assert(w != nullptr && (s != nullptr || len == 0));
+        if (writer_prefix(w) == WRITE_OK)
+            writer_put_string(w, s, len);
+        return w -> error;
+    }
+
+    int writer_value(writer *w, const value *v) {
+        assert(w != nullptr && v != nullptr);
+        switch (v -> type) {
+            case NUL: return writer_null(w);
+            case FALSE: return writer_boolean(w, 0);
+            case TRUE: return writer_boolean(w, 1);
+            case NUMBER: {
+                size_t len;
+                const char *raw = get_number_raw(v, &len);
+                if (raw == nullptr)
+                    return writer_number(w, get_number(v));
+                if (writer_prefix(w) == WRITE_OK) // pass the original text through
+                    writer_put(w, raw, len);
+                return w -> error;
+            }
+            case STRING: return writer_string(w, get_string(v), get_string_length(v));
+            case ARRAY:
+                writer_start_array(w);
+                for (size_t i = 0; i < v -> u.a.size && w -> error == WRITE_OK; i++)
+                    writer_value(w, &v -> u.a.e[i]);
+                return writer_end_array(w);
+            case OBJECT:
+                writer_start_object(w);
+                for (size_t i = 0; i < v -> u.o.size && w -> error == WRITE_OK; i++) {
+                    writer_key(w, member_key(&v -> u.o.m[i]), v -> u.o.m[i].kLen);
+                    writer_value(w, &v -> u.o.m[i].v);
+                }
+                return writer_end_object(w);
+        }
+        return w -> error;
+    }
+
+    int writer_finish(writer *w) {
+        assert(w != nullptr);
+        if (w -> error == WRITE_OK && (w -> depth != 0 || w -> state[0] != WRITER_ROOT_DONE))
+            return w -> error = WRITE_INVALID_STATE;
+        writer_flush(w);
+        return w -> error;
+    }
+
+
+    /* shared documents */
+
+    const document* freeze(value *v) {
+        document *d = new document();
+        assert(v != nullptr);
+        move(&d -> root, v);
+        freeze_value(&d -> root);
+        return d;
+    }
+
+    const value* document_root(const document *d) {
+        assert(d != nullptr);
+        return &d -> root;
+    }
+
+    const document* document_retain(const document *d) {
+        assert(d != nullptr);
+        ((document*)d) -> refs.fetch_add(1, std::memory_order_relaxed);
+        return d;
+    }
+
+    void document_release(const document *d) {
+        if (d != nullptr && ((document*)d) -> refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            fre(&((document*)d) -> root);
+            delete d;
+        }
+    }
+
+    int derive(const document **out, const document *base, const value *patch) {
+        context c;
+        document *d;
+        int ret;
+        assert(out != nullptr && base != nullptr && patch != nullptr);
+
+        d = new document();
+        memcpy(&d -> root, &base -> root, sizeof(value));
+        block_retain(&d -> root);
+
+        c.flags = CONTEXT_COPY_ON_WRITE;
+        if ((ret = apply_operations(&c, &d -> root, patch)) != PATCH_OK) {
+            document_release(d); // base is untouched, blocks were copied before any change
+            d = nullptr;
+        }
+        *out = d;
+        return ret;
+    }
+
+    const document* document_acquire(document_slot *s) {
+        const document *d;
+        assert(s != nullptr);
+        while (s -> lock.test_and_set(std::memory_order_acquire))
+            ;
+        if ((d = s -> doc) != nullptr)
+            document_retain(d);
+        s -> lock.clear(std::memory_order_release);
+        return d;
+    }
+
+    void document_publish(document_slot *s, const document *d) {
+        const document *old;
+        assert(s != nullptr);
+        while (s -> lock.test_and_set(std::memory_order_acquire))
+            ;
+        old = s -> doc;
+        s -> doc = d;
+        s -> lock.clear(std::memory_order_release);
+        document_release(old);
     }
 }
 
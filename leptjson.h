@@ -1,6 +1,7 @@
 #ifndef LEPTJSON_H
 #define LEPTJSON_H
 
+#include <atomic>
 #include <cstddef>
 
 namespace lept {
@@ -30,8 +31,49 @@ namespace lept {
         PARSE_MISS_COMMA_OR_CURLY_BRACKET,
     };
 
+    enum {
+        PATCH_OK = 0,
+        PATCH_INVALID_OPERATION,    // malformed operation object or unknown "op"
+        PATCH_INVALID_POINTER,      // malformed JSON Pointer, or move into its own child
+        PATCH_PATH_NOT_FOUND,
+        PATCH_TEST_FAILED,
+    };
+
+    enum {
+        WRITE_OK = 0,
+        WRITE_INVALID_STATE,    // token not allowed here, e.g. a value where a key is expected
+        WRITE_TOO_DEEP,         // more than WRITER_MAX_DEPTH nested containers
+        WRITE_INVALID_NUMBER,   // nan or inf
+        WRITE_IO_ERROR,
+    };
+
+    enum {
+        // numbers keep a pointer to their text and are converted on first get_number(),
+        // the json buffer must outlive the value and overflow is not reported by parse
+        PARSE_LAZY_NUMBER = 1 << 0,
+    };
+
+    enum {
+        PROJECTION_OK = 0,
+        PROJECTION_INVALID_PATH,
+    };
+
+    const size_t KEY_NOT_EXIST = (size_t)-1;
+
+    const size_t INLINE_STRING_CAPACITY = sizeof(char*) + sizeof(size_t);
+
+    // fixed rather than configurable, they size struct writer
+    const size_t WRITER_BUFFER_SIZE = 4096;
+    const size_t WRITER_MAX_DEPTH = 256;
+
+    enum {
+        VALUE_INLINE_STRING = 1 << 0,
+        VALUE_SHARED = 1 << 1, // heap storage is reference counted, see freeze()
+    };
+
     struct value;   // forward declare
     struct member;
+    struct projection; // trie of selected paths, see projection_compile()
 
     struct value {
         union {
@@ -48,19 +90,72 @@ namespace lept {
                 char *s;
                 size_t len;
             } s;
-            double n;
+            // strings shorter than INLINE_STRING_CAPACITY (VALUE_INLINE_STRING set),
+            // the last byte holds INLINE_STRING_CAPACITY - 1 - len so a full buffer ends in '\0'
+            char ss[INLINE_STRING_CAPACITY];
+            struct {
+                double d; // nan until a lazily parsed number is first read
+                const char *raw; // number text in the parsed input, or nullptr
+            } n;
         } u = {};
 
         var type = NUL;
+        unsigned char flags = 0; // storage flags, see VALUE_INLINE_STRING
     };
 
     struct member {
-        char *k = nullptr;
+        union {
+            char *k = nullptr;
+            char ik[sizeof(char*)]; // keys shorter than this are stored inline
+        };
         size_t kLen = 0;
         value v;
     };
 
-    int parse(value *v, const char *json);
+    // immutable, reference counted tree that can be read from any number of threads
+    struct document {
+        value root;
+        std::atomic<size_t> refs{1};
+    };
+
+    // holds the current version of a document, swapped by pointer under a spin lock
+    struct document_slot {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        const document *doc = nullptr;
+    };
+
+    // result of parse_many(), a single block holding every message and its storage
+    struct batch {
+        size_t size = 0;
+        const int *status = nullptr;   // PARSE_* code of each message
+        const value *values = nullptr; // values[i] is null unless status[i] == PARSE_OK
+    };
+
+    // returns 0 on success, anything else aborts the writer with WRITE_IO_ERROR
+    typedef int (*write_func)(void *user, const char *data, size_t len);
+
+    // push-style writer, memory use is fixed by WRITER_BUFFER_SIZE and WRITER_MAX_DEPTH
+    struct writer {
+        write_func out = nullptr;
+        void *user = nullptr;
+        int fd = -1;
+        int error = 0;      // sticky, every call after a failure returns it
+        size_t depth = 0;
+        size_t len = 0;     // bytes pending in buffer
+        unsigned char state[WRITER_MAX_DEPTH + 1] = {}; // state[0] is the root
+        char buffer[WRITER_BUFFER_SIZE];
+    };
+
+    int parse(value *v, const char *json, unsigned flags = 0);
+    // paths look like "$.user.id", "$.events[*].ts", "$.*.id" or "$['a.b']"
+    int projection_compile(projection **out, const char *const *paths, size_t n);
+    void projection_free(projection *p);
+    // members and elements outside the projection are validated but never allocated
+    int parse_projected(value *v, const char *json, const projection *p, unsigned flags = 0);
+    // parses message i from lens[i] bytes at buf + offsets[i], no terminator needed;
+    // the values are read only, buf may be released and batch_free() releases them all
+    const batch* parse_many(const char *buf, const size_t *offsets, const size_t *lens, size_t n, unsigned flags = 0);
+    void batch_free(const batch *b);
     void fre(value *v); // different from free
 
     const char* get_string(const value *v);
@@ -77,6 +172,45 @@ namespace lept {
 
     var get_type(const value *v);
     double get_number(const value *v);
+    const char* get_number_raw(const value *v, size_t *len); // nullptr unless parsed with PARSE_LAZY_NUMBER
+
+    int is_equal(const value *lhs, const value *rhs);
+    void copy(value *dst, const value *src); // deep copy, dst is freed first
+    void move(value *dst, value *src); // src becomes null
+    void swap(value *lhs, value *rhs);
+
+    size_t find_object_index(const value *v, const char *key, size_t kLen);
+    value* find_object_value(const value *v, const char *key, size_t kLen);
+
+    // RFC 6902 JSON Patch: diff() writes an array of operations turning a into b,
+    // apply_patch() applies them to v in place (v may be partially patched on error)
+    void diff(value *patch, const value *a, const value *b);
+    int apply_patch(value *v, const value *patch);
+    // RFC 7386 JSON Merge Patch
+    void merge_patch(value *target, const value *patch);
+
+    const document* freeze(value *v); // takes over the tree, v becomes null
+    const value* document_root(const document *d);
+    const document* document_retain(const document *d);
+    void document_release(const document *d);
+    // applies a JSON Patch copy-on-write, unchanged subtrees stay shared with base
+    int derive(const document **out, const document *base, const value *patch);
+    const document* document_acquire(document_slot *s); // retained, release it when done
+    void document_publish(document_slot *s, const document *d); // takes over d, releases the old version
+
+    void writer_init_fd(writer *w, int fd);
+    void writer_init_callback(writer *w, write_func out, void *user);
+    int writer_start_object(writer *w);
+    int writer_end_object(writer *w);
+    int writer_start_array(writer *w);
+    int writer_end_array(writer *w);
+    int writer_key(writer *w, const char *k, size_t len);
+    int writer_null(writer *w);
+    int writer_boolean(writer *w, int b);
+    int writer_number(writer *w, double n);
+    int writer_string(writer *w, const char *s, size_t len);
+    int writer_value(writer *w, const value *v); // writes a whole tree
+    int writer_finish(writer *w); // checks the document is complete and flushes
 }
 
 #endif // LEPTJSON_H
@@ -4,8 +4,10 @@
 #endif
 
 #include "leptjson.h"
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <thread>
 
 static int main_ret = 0;
 static int test_count = 0;
@@ -139,6 +141,59 @@ static void test_parse_number() {
     TEST_NUMBER(-1.7976931348623157e+308, "-1.7976931348623157e+308");
 }
 
+#define TEST_LAZY_NUMBER(expect, json)\
+    do {\
+        lept::value v;\
+        size_t len;\
+        const char *raw;\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, json, lept::PARSE_LAZY_NUMBER));\
+        EXPECT_EQ_INT(lept::NUMBER, lept::get_type(&v));\
+        raw = lept::get_number_raw(&v, &len);\
+        EXPECT_EQ_STRING(json, raw, len);\
+        EXPECT_EQ_DOUBLE(expect, lept::get_number(&v));\
+        EXPECT_EQ_DOUBLE(expect, lept::get_number(&v));\
+    } while(0)
+
+#define TEST_LAZY_ERROR(error, json)\
+    do {\
+        lept::value v;\
+        v.type = lept::FALSE;\
+        EXPECT_EQ_INT(error, lept::parse(&v, json, lept::PARSE_LAZY_NUMBER));\
+        EXPECT_EQ_INT(lept::NUL, lept::get_type(&v));\
+    } while(0)
+
+static void test_parse_lazy_number() {
+    lept::value v;
+    const char *raw;
+    size_t len;
+
+    TEST_LAZY_NUMBER(0.0, "0");
+    TEST_LAZY_NUMBER(0.0, "-0");
+    TEST_LAZY_NUMBER(-1.5, "-1.5");
+    TEST_LAZY_NUMBER(1.234E+10, "1.234E+10");
+    TEST_LAZY_NUMBER(-1E-10, "-1E-10");
+    TEST_LAZY_NUMBER(1.0000000000000002, "1.0000000000000002");
+    TEST_LAZY_NUMBER(-1.7976931348623157e+308, "-1.7976931348623157e+308");
+    TEST_LAZY_NUMBER(HUGE_VAL, "1e309"); /* not checked until read */
+
+    TEST_LAZY_ERROR(lept::PARSE_INVALID_VALUE, "1.");
+    TEST_LAZY_ERROR(lept::PARSE_INVALID_VALUE, "-");
+    TEST_LAZY_ERROR(lept::PARSE_INVALID_VALUE, "1e");
+    TEST_LAZY_ERROR(lept::PARSE_INVALID_VALUE, "[1,.5]");
+    TEST_LAZY_ERROR(lept::PARSE_ROOT_NOT_SINGULAR, "0122");
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, "[ 1.50 , 2e0 ]", lept::PARSE_LAZY_NUMBER));
+    raw = lept::get_number_raw(lept::get_array_element(&v, 0), &len);
+    EXPECT_EQ_STRING("1.50", raw, len);
+    raw = lept::get_number_raw(lept::get_array_element(&v, 1), &len);
+    EXPECT_EQ_STRING("2e0", raw, len);
+    EXPECT_EQ_DOUBLE(2.0, lept::get_number(lept::get_array_element(&v, 1)));
+    lept::fre(&v);
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, "1.5"));
+    EXPECT_TRUE(lept::get_number_raw(&v, &len) == nullptr);
+}
+
 static void test_parse_string() {
     TEST_STRING("\\", "\"\\\\\"");
     TEST_STRING("", "\"\"");
@@ -188,12 +243,163 @@ static void test_parse_array() {
     lept::fre(&v);
 }
 
+#define TEST_PROJECTION(expect, json, ...)\
+    do {\
+        const char *paths[] = { __VA_ARGS__ };\
+        lept::projection *p;\
+        lept::value v, e;\
+        EXPECT_EQ_INT(lept::PROJECTION_OK, lept::projection_compile(&p, paths, sizeof(paths) / sizeof(paths[0])));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse_projected(&v, json, p));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&e, expect));\
+        EXPECT_TRUE(lept::is_equal(&v, &e));\
+        lept::fre(&v);\
+        lept::fre(&e);\
+        lept::projection_free(p);\
+    } while(0)
+
+#define TEST_PROJECTION_ERROR(error, json, path)\
+    do {\
+        const char *paths[] = { path };\
+        lept::projection *p;\
+        lept::value v;\
+        v.type = lept::FALSE;\
+        EXPECT_EQ_INT(lept::PROJECTION_OK, lept::projection_compile(&p, paths, 1));\
+        EXPECT_EQ_INT(error, lept::parse_projected(&v, json, p));\
+        EXPECT_EQ_INT(lept::NUL, lept::get_type(&v));\
+        lept::projection_free(p);\
+    } while(0)
+
+static void test_parse_projected() {
+    const char *json =
+        "{ \"user\" : { \"id\" : 7, \"name\" : \"a name that is not needed\", \"tags\" : [ \"x\", { \"y\" : null } ] },"
+        "  \"events\" : [ { \"ts\" : 1, \"kind\" : \"open\" }, { \"ts\" : 2, \"kind\" : \"close\", \"extra\" : [1,2,3] } ],"
+        "  \"a.b\" : true, \"other\" : \"\\u20AC\\uD834\\uDD1E\" }";
+    const char *invalid[] = { "user.id", "$.", "$.user..id", "$[0]", "$['a.b'", "$.user[*" };
+
+    TEST_PROJECTION("{\"user\":{\"id\":7}}", json, "$.user.id");
+    TEST_PROJECTION("{\"events\":[{\"ts\":1},{\"ts\":2}]}", json, "$.events[*].ts");
+    TEST_PROJECTION("{\"user\":{\"id\":7},\"events\":[{\"ts\":1},{\"ts\":2}]}", json, "$.user.id", "$.events[*].ts");
+    TEST_PROJECTION("{\"user\":{\"id\":7,\"name\":\"a name that is not needed\",\"tags\":[\"x\",{\"y\":null}]}}", json, "$.user", "$.user.id");
+    TEST_PROJECTION("{\"a.b\":true}", json, "$['a.b']");
+    TEST_PROJECTION("{\"user\":{}}", json, "$.*.ts");
+    TEST_PROJECTION("{\"events\":[{},{\"extra\":[1,2,3]}]}", json, "$.events[*].extra");
+    TEST_PROJECTION("{}", json, "$.missing");
+    TEST_PROJECTION("[[1,2],[],[3]]", "[[1,2],3,[],{},[3]]", "$[*][*]", "$.ignored");
+    TEST_PROJECTION("[{\"ts\":1},{}]", "[{\"ts\":1},{\"id\":2},[{\"ts\":3}],4]", "$[*].ts");
+    TEST_PROJECTION("\"abc\"", "\"abc\"", "$.id"); /* the root is always kept */
+    TEST_PROJECTION("{\"a\":1}", "{\"a\":1,\"b\":1e400}", "$.a"); /* overflow is not checked when skipped */
+
+    /* members named explicitly are also reached through .* */
+    TEST_PROJECTION("{\"a\":{\"x\":1,\"y\":2},\"b\":{\"y\":4}}", "{\"a\":{\"x\":1,\"y\":2},\"b\":{\"x\":3,\"y\":4}}", "$.a.x", "$.*.y");
+    TEST_PROJECTION("{\"a\":{\"x\":1,\"y\":2},\"b\":{\"x\":3}}", "{\"a\":{\"x\":1,\"y\":2},\"b\":{\"x\":3}}", "$.*", "$.a.x");
+    TEST_PROJECTION("{\"a\":{\"b\":{\"x\":1,\"y\":2}},\"c\":{\"b\":{\"y\":4}}}",
+        "{\"a\":{\"b\":{\"x\":1,\"y\":2}},\"c\":{\"b\":{\"x\":3,\"y\":4}}}", "$.a.b.x", "$.*.*.y");
+
+    /* skipped values are still validated */
+    TEST_PROJECTION_ERROR(lept::PARSE_INVALID_STRING_ESCAPE, "{\"a\":1,\"b\":\"\\x\"}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_INVALID_UNICODE_SURROGATE, "{\"a\":1,\"b\":\"\\uD800\"}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_MISS_QUOTATION_MARK, "{\"a\":1,\"b\":\"abc}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_INVALID_VALUE, "{\"a\":1,\"b\":[nul]}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_INVALID_VALUE, "{\"a\":1,\"b\":-}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"a\":1,\"b\":[1 2]}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_MISS_COLON, "{\"a\":1,\"b\":{\"c\" 1}}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_MISS_KEY, "{\"a\":1,\"b\":{1:1}}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"b\":{\"c\":1 \"d\":2},\"a\":1}", "$.a");
+    TEST_PROJECTION_ERROR(lept::PARSE_ROOT_NOT_SINGULAR, "{\"a\":1} x", "$.a");
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        lept::projection *p = (lept::projection*)&p;
+        EXPECT_EQ_INT(lept::PROJECTION_INVALID_PATH, lept::projection_compile(&p, &invalid[i], 1));
+        EXPECT_TRUE(p == nullptr);
+    }
+}
+
+static void test_parse_many() {
+    /* messages sit back to back without terminators */
+    const char buf[] = "{\"id\":1,\"name\":\"a name too long to be inline\"}[1,[2,\"x\"]]{\"a\":[1,}  \"a string too long to be inline\" 1e309 2 3";
+    const size_t offsets[] = { 0, 46, 57, 66, 100, 106 };
+    const size_t lens[] = { 46, 11, 9, 34, 6, 4 };
+    const lept::batch *b;
+    const lept::value *v;
+    lept::value expect;
+    size_t len;
+
+    b = lept::parse_many(buf, offsets, lens, 6);
+    EXPECT_EQ_INT(6, b -> size);
+    EXPECT_EQ_INT(lept::PARSE_OK, b -> status[0]);
+    EXPECT_EQ_INT(lept::PARSE_OK, b -> status[1]);
+    EXPECT_EQ_INT(lept::PARSE_INVALID_VALUE, b -> status[2]);
+    EXPECT_EQ_INT(lept::PARSE_OK, b -> status[3]);
+    EXPECT_EQ_INT(lept::PARSE_NUMBER_TOO_BIG, b -> status[4]);
+    EXPECT_EQ_INT(lept::PARSE_ROOT_NOT_SINGULAR, b -> status[5]);
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&expect, "{\"id\":1,\"name\":\"a name too long to be inline\"}"));
+    EXPECT_TRUE(lept::is_equal(&expect, &b -> values[0]));
+    lept::fre(&expect);
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&expect, "[1,[2,\"x\"]]"));
+    EXPECT_TRUE(lept::is_equal(&expect, &b -> values[1]));
+    lept::fre(&expect);
+    EXPECT_EQ_INT(lept::NUL, lept::get_type(&b -> values[2]));
+    EXPECT_EQ_STRING("a string too long to be inline", lept::get_string(&b -> values[3]), lept::get_string_length(&b -> values[3]));
+    EXPECT_EQ_INT(lept::NUL, lept::get_type(&b -> values[5]));
+
+    /* values can be copied out of the batch */
+    lept::copy(&expect, &b -> values[0]);
+    lept::batch_free(b);
+    EXPECT_EQ_STRING("a name too long to be inline", lept::get_string(lept::find_object_value(&expect, "name", 4)),
+                     lept::get_string_length(lept::find_object_value(&expect, "name", 4)));
+    lept::fre(&expect);
+
+    /* lazy numbers point into the batch, not into buf */
+    b = lept::parse_many(buf, offsets, lens, 2, lept::PARSE_LAZY_NUMBER);
+    v = lept::get_array_element(lept::get_array_element(&b -> values[1], 1), 0);
+    EXPECT_TRUE(lept::get_number_raw(v, &len) < buf || lept::get_number_raw(v, &len) >= buf + sizeof(buf));
+    EXPECT_EQ_STRING("2", lept::get_number_raw(v, &len), len);
+    EXPECT_EQ_DOUBLE(2.0, lept::get_number(v));
+    EXPECT_EQ_DOUBLE(1.0, lept::get_number(lept::find_object_value(&b -> values[0], "id", 2)));
+    lept::batch_free(b);
+
+    /* messages are delimited by length, not by a NUL byte */
+    {
+        const char nul[] = "1\0garbage";
+        const size_t offset = 0, nulLen = sizeof(nul) - 1;
+        b = lept::parse_many(nul, &offset, &nulLen, 1);
+        EXPECT_EQ_INT(lept::PARSE_ROOT_NOT_SINGULAR, b -> status[0]);
+        EXPECT_EQ_INT(lept::NUL, lept::get_type(&b -> values[0]));
+        lept::batch_free(b);
+    }
+
+    b = lept::parse_many(nullptr, nullptr, nullptr, 0);
+    EXPECT_EQ_INT(0, b -> size);
+    lept::batch_free(b);
+}
+
 static void test_access_string() {
     lept::value v;
     lept::set_string(&v, "", 0);
     EXPECT_EQ_STRING("", lept::get_string(&v), lept::get_string_length(&v));
     lept::set_string(&v, "HELLO", 5);
     EXPECT_EQ_STRING("HELLO", lept::get_string(&v), lept::get_string_length(&v));
+    lept::set_string(&v, "fifteen bytes!!", 15); /* largest inline string */
+    EXPECT_EQ_STRING("fifteen bytes!!", lept::get_string(&v), lept::get_string_length(&v));
+    lept::set_string(&v, "sixteen bytes!!!", 16);
+    EXPECT_EQ_STRING("sixteen bytes!!!", lept::get_string(&v), lept::get_string_length(&v));
+    lept::set_string(&v, "", 0);
+    EXPECT_EQ_STRING("", lept::get_string(&v), lept::get_string_length(&v));
+    lept::fre(&v);
+}
+
+static void test_access_object_key() {
+    lept::value v;
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, "{\"\":0,\"seven!!\":1,\"eight!!!\":2,\"a rather long key\":3}"));
+    EXPECT_EQ_INT(4, lept::get_object_size(&v));
+    EXPECT_EQ_STRING("", lept::get_object_key(&v, 0), lept::get_object_key_length(&v, 0));
+    EXPECT_EQ_STRING("seven!!", lept::get_object_key(&v, 1), lept::get_object_key_length(&v, 1));
+    EXPECT_EQ_STRING("eight!!!", lept::get_object_key(&v, 2), lept::get_object_key_length(&v, 2));
+    EXPECT_EQ_STRING("a rather long key", lept::get_object_key(&v, 3), lept::get_object_key_length(&v, 3));
+    EXPECT_EQ_INT(1, lept::find_object_index(&v, "seven!!", 7));
+    EXPECT_EQ_INT(2, lept::find_object_index(&v, "eight!!!", 8));
+    EXPECT_TRUE(lept::KEY_NOT_EXIST == lept::find_object_index(&v, "eight!!", 7));
     lept::fre(&v);
 }
 
@@ -254,11 +460,437 @@ static void test_parse_object() {
     lept::fre(&v);
 }
 
+#define TEST_EQUAL(json1, json2, equality)\
+    do {\
+        lept::value v1, v2;\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v1, json1));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v2, json2));\
+        EXPECT_EQ_INT(equality, lept::is_equal(&v1, &v2));\
+        lept::fre(&v1);\
+        lept::fre(&v2);\
+    } while(0)
+
+static void test_equal() {
+    TEST_EQUAL("true", "true", 1);
+    TEST_EQUAL("true", "false", 0);
+    TEST_EQUAL("false", "false", 1);
+    TEST_EQUAL("null", "null", 1);
+    TEST_EQUAL("null", "0", 0);
+    TEST_EQUAL("123", "123", 1);
+    TEST_EQUAL("123", "456", 0);
+    TEST_EQUAL("\"abc\"", "\"abc\"", 1);
+    TEST_EQUAL("\"abc\"", "\"abcd\"", 0);
+    TEST_EQUAL("[]", "[]", 1);
+    TEST_EQUAL("[]", "null", 0);
+    TEST_EQUAL("[1,2,3]", "[1,2,3]", 1);
+    TEST_EQUAL("[1,2,3]", "[1,2,3,4]", 0);
+    TEST_EQUAL("[[]]", "[[]]", 1);
+    TEST_EQUAL("{}", "{}", 1);
+    TEST_EQUAL("{}", "null", 0);
+    TEST_EQUAL("{}", "[]", 0);
+    TEST_EQUAL("{\"a\":1,\"b\":2}", "{\"a\":1,\"b\":2}", 1);
+    TEST_EQUAL("{\"a\":1,\"b\":2}", "{\"b\":2,\"a\":1}", 1);
+    TEST_EQUAL("{\"a\":1,\"b\":2}", "{\"a\":1,\"b\":3}", 0);
+    TEST_EQUAL("{\"a\":1,\"b\":2}", "{\"a\":1,\"b\":2,\"c\":3}", 0);
+    TEST_EQUAL("{\"a\":{\"b\":{\"c\":{}}}}", "{\"a\":{\"b\":{\"c\":{}}}}", 1);
+    TEST_EQUAL("{\"a\":{\"b\":{\"c\":{}}}}", "{\"a\":{\"b\":{\"c\":[]}}}", 0);
+}
+
+static void test_copy_move_swap() {
+    lept::value v1, v2, v3;
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v1, "{\"t\":true,\"f\":false,\"n\":null,\"d\":1.5,\"a\":[1,2,3]}"));
+    lept::copy(&v2, &v1);
+    EXPECT_TRUE(lept::is_equal(&v2, &v1));
+    lept::move(&v3, &v2);
+    EXPECT_EQ_INT(lept::NUL, lept::get_type(&v2));
+    EXPECT_TRUE(lept::is_equal(&v3, &v1));
+    lept::set_string(&v2, "Hello", 5);
+    lept::swap(&v2, &v3);
+    EXPECT_EQ_STRING("Hello", lept::get_string(&v3), lept::get_string_length(&v3));
+    EXPECT_TRUE(lept::is_equal(&v2, &v1));
+    lept::fre(&v1);
+    lept::fre(&v2);
+    lept::fre(&v3);
+}
+
+#define TEST_PATCH(expect, doc, patch, result)\
+    do {\
+        lept::value v, p, r;\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, doc));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p, patch));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&r, result));\
+        EXPECT_EQ_INT(expect, lept::apply_patch(&v, &p));\
+        if (expect == lept::PATCH_OK)\
+            EXPECT_TRUE(lept::is_equal(&v, &r));\
+        lept::fre(&v);\
+        lept::fre(&p);\
+        lept::fre(&r);\
+    } while(0)
+
+static void test_apply_patch() {
+    /* RFC 6902 appendix A */
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]", "{\"baz\":\"qux\",\"foo\":\"bar\"}");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":[\"bar\",\"baz\"]}", "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]", "{\"foo\":[\"bar\",\"qux\",\"baz\"]}");
+    TEST_PATCH(lept::PATCH_OK, "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"remove\",\"path\":\"/baz\"}]", "{\"foo\":\"bar\"}");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]", "{\"foo\":[\"bar\",\"baz\"]}");
+    TEST_PATCH(lept::PATCH_OK, "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"/baz\",\"value\":\"boo\"}]", "{\"baz\":\"boo\",\"foo\":\"bar\"}");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},\"qux\":{\"corge\":\"grault\"}}",
+        "[{\"op\":\"move\",\"from\":\"/foo/waldo\",\"path\":\"/qux/thud\"}]",
+        "{\"foo\":{\"bar\":\"baz\"},\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}", "[{\"op\":\"move\",\"from\":\"/foo/1\",\"path\":\"/foo/3\"}]",
+        "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}");
+    TEST_PATCH(lept::PATCH_OK, "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+        "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]",
+        "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}");
+    TEST_PATCH(lept::PATCH_TEST_FAILED, "{\"baz\":\"qux\"}", "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]", "null");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/child\",\"value\":{\"grandchild\":{}}}]",
+        "{\"foo\":\"bar\",\"child\":{\"grandchild\":{}}}");
+    TEST_PATCH(lept::PATCH_PATH_NOT_FOUND, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz/bat\",\"value\":\"qux\"}]", "null");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":[\"bar\"]}", "[{\"op\":\"add\",\"path\":\"/foo/-\",\"value\":[\"abc\",\"def\"]}]",
+        "{\"foo\":[\"bar\",[\"abc\",\"def\"]]}");
+    TEST_PATCH(lept::PATCH_OK, "{\"/\":0,\"~\":1}", "[{\"op\":\"copy\",\"from\":\"/~1\",\"path\":\"/~0\"}]", "{\"/\":0,\"~\":0}");
+    TEST_PATCH(lept::PATCH_OK, "{\"foo\":1}", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1]}]", "[1]");
+    TEST_PATCH(lept::PATCH_OK, "{}", "[{\"op\":\"add\",\"path\":\"/\",\"value\":5}]", "{\"\":5}");
+    TEST_PATCH(lept::PATCH_OK, "{\"\":{\"\":1}}", "[{\"op\":\"replace\",\"path\":\"//\",\"value\":2}]", "{\"\":{\"\":2}}");
+
+    TEST_PATCH(lept::PATCH_INVALID_OPERATION, "{}", "[{\"op\":\"nop\",\"path\":\"\"}]", "null");
+    TEST_PATCH(lept::PATCH_INVALID_OPERATION, "{}", "[{\"op\":\"add\",\"path\":\"/a\"}]", "null");
+    TEST_PATCH(lept::PATCH_INVALID_POINTER, "{}", "[{\"op\":\"add\",\"path\":\"a\",\"value\":1}]", "null");
+    TEST_PATCH(lept::PATCH_INVALID_POINTER, "{}", "[{\"op\":\"add\",\"path\":\"/~2\",\"value\":1}]", "null");
+    TEST_PATCH(lept::PATCH_INVALID_POINTER, "{\"a\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]", "null");
+    TEST_PATCH(lept::PATCH_PATH_NOT_FOUND, "[1,2]", "[{\"op\":\"add\",\"path\":\"/3\",\"value\":1}]", "null");
+    TEST_PATCH(lept::PATCH_PATH_NOT_FOUND, "[1,2]", "[{\"op\":\"remove\",\"path\":\"/01\"}]", "null");
+    TEST_PATCH(lept::PATCH_PATH_NOT_FOUND, "{\"a\":1}", "[{\"op\":\"replace\",\"path\":\"/b\",\"value\":1}]", "null");
+}
+
+#define TEST_DIFF(json1, json2, count)\
+    do {\
+        lept::value a, b, p;\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&a, json1));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&b, json2));\
+        lept::diff(&p, &a, &b);\
+        EXPECT_EQ_INT(count, lept::get_array_size(&p));\
+        EXPECT_EQ_INT(lept::PATCH_OK, lept::apply_patch(&a, &p));\
+        EXPECT_TRUE(lept::is_equal(&a, &b));\
+        lept::fre(&a);\
+        lept::fre(&b);\
+        lept::fre(&p);\
+    } while(0)
+
+static void test_diff() {
+    TEST_DIFF("null", "null", 0);
+    TEST_DIFF("{\"a\":[1,2,{\"b\":\"c\"}]}", "{\"a\":[1,2,{\"b\":\"c\"}]}", 0);
+    TEST_DIFF("{\"b\":2,\"a\":1}", "{\"a\":1,\"b\":2}", 0);
+    TEST_DIFF("1", "\"1\"", 1);
+    TEST_DIFF("{\"a\":1,\"b\":2}", "{\"a\":1,\"b\":3}", 1);
+    TEST_DIFF("{\"a\":1,\"b\":{\"c\":2},\"d\":3}", "{\"d\":3,\"b\":{\"c\":4},\"a\":1}", 1);
+    TEST_DIFF("{\"a\":1,\"b\":2}", "{\"a\":1}", 1);
+    TEST_DIFF("{\"a\":1}", "{\"a\":1,\"a/b~\":{}}", 1);
+    TEST_DIFF("{\"\":1}", "{\"\":2}", 1);
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,9,4,5]", 1);
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,4,5]", 1);
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,3,7,8,4,5]", 2);
+    TEST_DIFF("[1,2,3,4,5]", "[]", 5);
+    TEST_DIFF("[]", "[1,[2]]", 2);
+    TEST_DIFF("{\"x\":{\"y\":[{\"z\":0},{\"z\":1}]},\"w\":true}", "{\"x\":{\"y\":[{\"z\":0},{\"z\":2}]},\"w\":true}", 1);
+    TEST_DIFF("{\"x\":[true,false,null]}", "[\"x\",true,false,null]", 1);
+
+    /* changes whose hashes collided or cancelled out */
+    TEST_DIFF("{\"k\":true}", "{\"k\":[null,[]]}", 1);
+    TEST_DIFF("[[[],{\"\":0,\"~/\":-0},2],true]", "[[-0,0],[null,[]],0]", 5);
+    TEST_DIFF("{\"x\":{\"k\":\"s0\"}}", "{\"x\":{\"k\":4.8442902477434134e-266}}", 1);
+}
+
+#define TEST_MERGE_PATCH(target, patch, result)\
+    do {\
+        lept::value t, p, r;\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&t, target));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p, patch));\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&r, result));\
+        lept::merge_patch(&t, &p);\
+        EXPECT_TRUE(lept::is_equal(&t, &r));\
+        lept::fre(&t);\
+        lept::fre(&p);\
+        lept::fre(&r);\
+    } while(0)
+
+static void test_merge_patch() {
+    /* RFC 7386 appendix A */
+    TEST_MERGE_PATCH("{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":\"b\"}", "{\"a\":null}", "{}");
+    TEST_MERGE_PATCH("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":[\"b\"]}");
+    TEST_MERGE_PATCH("{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}");
+    TEST_MERGE_PATCH("{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}", "{\"a\":[1]}");
+    TEST_MERGE_PATCH("[\"a\",\"b\"]", "[\"c\",\"d\"]", "[\"c\",\"d\"]");
+    TEST_MERGE_PATCH("{\"a\":\"b\"}", "[\"c\"]", "[\"c\"]");
+    TEST_MERGE_PATCH("{\"a\":\"foo\"}", "null", "null");
+    TEST_MERGE_PATCH("{\"a\":\"foo\"}", "\"bar\"", "\"bar\"");
+    TEST_MERGE_PATCH("{\"e\":null}", "{\"a\":1}", "{\"e\":null,\"a\":1}");
+    TEST_MERGE_PATCH("[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}");
+    TEST_MERGE_PATCH("{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}");
+}
+
+struct sink {
+    char data[1024];
+    size_t len;
+    size_t calls;
+};
+
+static int sink_write(void *user, const char *data, size_t len) {
+    sink *s = (sink*)user;
+    if (s -> len + len > sizeof(s -> data))
+        return -1;
+    memcpy(s -> data + s -> len, data, len);
+    s -> len += len;
+    s -> calls++;
+    return 0;
+}
+
+#define TEST_ROUNDTRIP(json)\
+    do {\
+        lept::value v;\
+        lept::writer w;\
+        sink s = {};\
+        EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, json));\
+        lept::writer_init_callback(&w, sink_write, &s);\
+        EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_value(&w, &v));\
+        EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_finish(&w));\
+        EXPECT_EQ_STRING(json, s.data, s.len);\
+        lept::fre(&v);\
+    } while(0)
+
+static void test_writer_roundtrip() {
+    TEST_ROUNDTRIP("null");
+    TEST_ROUNDTRIP("false");
+    TEST_ROUNDTRIP("true");
+    TEST_ROUNDTRIP("0");
+    TEST_ROUNDTRIP("-1.5");
+    TEST_ROUNDTRIP("1.0000000000000002");
+    TEST_ROUNDTRIP("4.9406564584124654e-324");
+    TEST_ROUNDTRIP("1.7976931348623157e+308");
+    TEST_ROUNDTRIP("\"\"");
+    TEST_ROUNDTRIP("\"Hello\"");
+    TEST_ROUNDTRIP("\"Hello\\nWorld\"");
+    TEST_ROUNDTRIP("\"\\\" \\\\ / \\b \\f \\n \\r \\t\"");
+    TEST_ROUNDTRIP("\"Hello\\u0000\"");
+    TEST_ROUNDTRIP("\"a long run of plain text before an escape\\u001F and after it, plain again\"");
+    TEST_ROUNDTRIP("\"\xE2\x82\xAC\xF0\x9D\x84\x9E utf-8 passes through\"");
+    TEST_ROUNDTRIP("[]");
+    TEST_ROUNDTRIP("[null,false,true,123,\"abc\",[1,2,3]]");
+    TEST_ROUNDTRIP("{}");
+    TEST_ROUNDTRIP("{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3}}");
+}
+
+static void test_writer_lazy_number() {
+    lept::value v;
+    lept::writer w;
+    sink s = {};
+    const char *json = "[1.50,1e400,-0.0,0.1000000000000000000001]"; /* kept verbatim */
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, json, lept::PARSE_LAZY_NUMBER));
+    lept::writer_init_callback(&w, sink_write, &s);
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_value(&w, &v));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_finish(&w));
+    EXPECT_TRUE(strlen(json) == s.len && memcmp(json, s.data, s.len) == 0);
+    lept::fre(&v);
+}
+
+static void test_writer() {
+    lept::writer w;
+    sink s = {};
+    lept::writer_init_callback(&w, sink_write, &s);
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_start_object(&w));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_key(&w, "a", 1));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_start_array(&w));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_number(&w, 1));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_string(&w, "x\"", 2));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_end_array(&w));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_key(&w, "b", 1));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_boolean(&w, 0));
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_end_object(&w));
+    EXPECT_EQ_INT(0, s.calls); /* still buffered */
+    EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_finish(&w));
+    EXPECT_EQ_INT(1, s.calls);
+    EXPECT_EQ_STRING("{\"a\":[1,\"x\\\"\"],\"b\":false}", s.data, s.len);
+
+    /* a failing sink aborts the writer */
+    s.len = s.calls = 0;
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_start_array(&w);
+    for (int i = 0; i < 400; i++)
+        lept::writer_null(&w);
+    lept::writer_end_array(&w);
+    EXPECT_EQ_INT(lept::WRITE_IO_ERROR, lept::writer_finish(&w));
+
+    /* fd output */
+    {
+        FILE *f = tmpfile();
+        char buffer[32];
+        size_t n;
+        lept::writer_init_fd(&w, fileno(f));
+        lept::writer_start_array(&w);
+        lept::writer_number(&w, 42);
+        lept::writer_end_array(&w);
+        EXPECT_EQ_INT(lept::WRITE_OK, lept::writer_finish(&w));
+        rewind(f);
+        n = fread(buffer, 1, sizeof(buffer), f);
+        EXPECT_EQ_STRING("[42]", buffer, n);
+        fclose(f);
+    }
+}
+
+static void test_writer_error() {
+    lept::writer w;
+    sink s = {};
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_key(&w, "a", 1));
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_null(&w)); /* errors are sticky */
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_start_object(&w);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_null(&w));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_start_object(&w);
+    lept::writer_key(&w, "a", 1);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_end_object(&w));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_start_array(&w);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_end_object(&w));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_null(&w);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_null(&w)); /* root not singular */
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    lept::writer_start_array(&w);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_finish(&w));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_STATE, lept::writer_finish(&w));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    EXPECT_EQ_INT(lept::WRITE_INVALID_NUMBER, lept::writer_number(&w, HUGE_VAL));
+
+    lept::writer_init_callback(&w, sink_write, &s);
+    for (size_t i = 0; i < lept::WRITER_MAX_DEPTH; i++)
+        lept::writer_start_array(&w);
+    EXPECT_EQ_INT(lept::WRITE_TOO_DEEP, lept::writer_start_array(&w));
+}
+
+static void test_document() {
+    lept::value v, p, expect;
+    const lept::document *base, *next, *fail;
+    const lept::value *root;
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v,
+        "{\"a\":{\"x\":1},\"b\":[1,2,3],\"c\":\"a string too long to be inline\",\"n\":1.5}", lept::PARSE_LAZY_NUMBER));
+    base = lept::freeze(&v);
+    EXPECT_EQ_INT(lept::NUL, lept::get_type(&v));
+    root = lept::document_root(base);
+    EXPECT_EQ_INT(4, lept::get_object_size(root));
+    EXPECT_EQ_DOUBLE(1.5, lept::get_number(lept::find_object_value(root, "n", 1)));
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p,
+        "[{\"op\":\"replace\",\"path\":\"/a/x\",\"value\":2},{\"op\":\"add\",\"path\":\"/b/-\",\"value\":[4]},"
+        "{\"op\":\"copy\",\"from\":\"/c\",\"path\":\"/d\"}]"));
+    EXPECT_EQ_INT(lept::PATCH_OK, lept::derive(&next, base, &p));
+    lept::fre(&p);
+
+    /* base is unchanged */
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&expect,
+        "{\"a\":{\"x\":1},\"b\":[1,2,3],\"c\":\"a string too long to be inline\",\"n\":1.5}"));
+    EXPECT_TRUE(lept::is_equal(lept::document_root(base), &expect));
+    lept::fre(&expect);
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&expect,
+        "{\"a\":{\"x\":2},\"b\":[1,2,3,[4]],\"c\":\"a string too long to be inline\",\"n\":1.5,"
+        "\"d\":\"a string too long to be inline\"}"));
+    EXPECT_TRUE(lept::is_equal(lept::document_root(next), &expect));
+    lept::fre(&expect);
+
+    /* untouched subtrees are shared, not copied */
+    EXPECT_TRUE(lept::get_string(lept::find_object_value(root, "c", 1)) ==
+                lept::get_string(lept::find_object_value(lept::document_root(next), "c", 1)));
+    EXPECT_TRUE(lept::get_string(lept::find_object_value(root, "c", 1)) ==
+                lept::get_string(lept::find_object_value(lept::document_root(next), "d", 1)));
+    EXPECT_FALSE(lept::get_array_element(lept::find_object_value(root, "b", 1), 0) ==
+                 lept::get_array_element(lept::find_object_value(lept::document_root(next), "b", 1), 0));
+
+    /* only the root is written here, the blocks under /a and /b stay shared */
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p,
+        "[{\"op\":\"test\",\"path\":\"/a/x\",\"value\":1},{\"op\":\"copy\",\"from\":\"/b/0\",\"path\":\"/e\"}]"));
+    EXPECT_EQ_INT(lept::PATCH_OK, lept::derive(&fail, base, &p));
+    EXPECT_TRUE(lept::find_object_value(lept::find_object_value(root, "a", 1), "x", 1) ==
+                lept::find_object_value(lept::find_object_value(lept::document_root(fail), "a", 1), "x", 1));
+    EXPECT_TRUE(lept::get_array_element(lept::find_object_value(root, "b", 1), 0) ==
+                lept::get_array_element(lept::find_object_value(lept::document_root(fail), "b", 1), 0));
+    lept::document_release(fail);
+    lept::fre(&p);
+
+    /* a failed patch leaves no document behind */
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p, "[{\"op\":\"remove\",\"path\":\"/a/x\"},{\"op\":\"test\",\"path\":\"/n\",\"value\":0}]"));
+    EXPECT_EQ_INT(lept::PATCH_TEST_FAILED, lept::derive(&fail, base, &p));
+    EXPECT_TRUE(fail == nullptr);
+    EXPECT_TRUE(lept::find_object_value(lept::find_object_value(root, "a", 1), "x", 1) != nullptr);
+    lept::fre(&p);
+
+    /* versions are independent once derived */
+    lept::document_release(base);
+    EXPECT_EQ_STRING("a string too long to be inline",
+        lept::get_string(lept::find_object_value(lept::document_root(next), "c", 1)),
+        lept::get_string_length(lept::find_object_value(lept::document_root(next), "c", 1)));
+    EXPECT_TRUE(lept::document_retain(next) == next);
+    lept::document_release(next);
+    lept::document_release(next);
+}
+
+static void test_document_slot() {
+    lept::document_slot slot;
+    lept::value v, p;
+    std::atomic<int> stop(0), errors(0);
+    std::thread readers[4];
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&v, "{\"version\":0,\"routes\":[\"a\",\"b\",\"c\"]}"));
+    lept::document_publish(&slot, lept::freeze(&v));
+    for (int i = 0; i < 4; i++) {
+        readers[i] = std::thread([&slot, &stop, &errors] {
+            while (!stop.load()) {
+                const lept::document *d = lept::document_acquire(&slot);
+                const lept::value *routes = lept::find_object_value(lept::document_root(d), "routes", 6);
+                if (routes == nullptr || lept::get_array_size(routes) != 3 ||
+                    lept::get_string_length(lept::get_array_element(routes, 2)) != 1)
+                    errors++;
+                lept::document_release(d);
+            }
+        });
+    }
+
+    EXPECT_EQ_INT(lept::PARSE_OK, lept::parse(&p, "[{\"op\":\"replace\",\"path\":\"/version\",\"value\":1}]"));
+    for (int i = 0; i < 1000; i++) {
+        const lept::document *current = lept::document_acquire(&slot), *next;
+        if (lept::derive(&next, current, &p) != lept::PATCH_OK)
+            errors++;
+        lept::document_release(current);
+        lept::document_publish(&slot, next);
+    }
+    stop = 1;
+    for (int i = 0; i < 4; i++)
+        readers[i].join();
+    lept::fre(&p);
+    EXPECT_EQ_INT(0, errors.load());
+    lept::document_publish(&slot, nullptr);
+}
+
 static void test_parse() {
     test_parse_null();
     test_parse_true();
     test_parse_false();
     test_parse_number();
+    test_parse_lazy_number();
     test_parse_string();
     test_parse_array();
     test_parse_object();
@@ -266,8 +898,28 @@ static void test_parse() {
     test_parse_invalid_value();
     test_parse_root_not_singular();
     test_parse_number_too_big();
+    test_parse_projected();
+    test_parse_many();
 
     test_access_string();
+    test_access_object_key();
+}
+
+static void test_patch() {
+    test_equal();
+    test_copy_move_swap();
+    test_apply_patch();
+    test_diff();
+    test_merge_patch();
+    test_document();
+    test_document_slot();
+}
+
+static void test_write() {
+    test_writer_roundtrip();
+    test_writer_lazy_number();
+    test_writer();
+    test_writer_error();
 }
 
 int main() {
@@ -277,6 +929,8 @@ int main() {
     #endif
 
     test_parse();
+    test_patch();
+    test_write();
     printf("%d/%d (%3.2f%%) passed\n", test_pass, test_count, test_pass * 100.0 / test_count);
     return main_ret;
 }
\ No newline at end of file